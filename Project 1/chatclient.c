@@ -2,8 +2,8 @@
 ** Author: Eddie C. Fox
 ** Date: February 18, 2017
 ** Description: This is the chatclient.c program to be run on host B with the following parameters:
-** <program name> <hostname> <portnumber>. It will connect to host A, running the chatserve.py 
-** program and attempt to chat with it. 
+** <program name> [-t seconds] <hostname> <portnumber>. It will connect to host A, running the chatserve.py 
+** program and attempt to chat with it. -t sets how long to keep trying to connect (10 seconds by default).
 ***********************/
 
 /* Some standard includes from the beej networking guide. */
@@ -11,11 +11,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include "../common/framing.h" /* Length prefixed framing shared with Project 2. */
+
+#define MAXADDRESSES 32     /* Most addresses of the server we will try. */
+#define STAGGER 250         /* Milliseconds to give one connection attempt before starting the next. */
+#define CONNECTTIMEOUT 10   /* Default seconds to keep trying before giving up. Change it with -t. */
+#define CACHEFILE ".chatclient_addresses" /* In the home directory. Remembers which address worked for each server. */
+#define CACHEENTRIES 16     /* How many servers the cache remembers. */
 
 /**********************
 **                       void getClientName(char *parameter)
@@ -35,7 +48,8 @@ void getClientName(char *parameter)
 ** Description: This function returns a pointer to an addrinfo structure, the details of which
 ** we create in this function. It takes the two arguments from the command line of starting the program
 ** (after the executable name), hostName and prtNumber. Beej guide used the terms hint and res for two 
-** addrinfo structures, so I am just going with that. 
+** addrinfo structures, so I am just going with that. Both IPv4 and IPv6 addresses are returned, and
+** connectSocket() tries them all.
 **********************/
 
 struct addrinfo* getAddressInfo(char *hostName, char *portNumber)
@@ -44,8 +58,9 @@ struct addrinfo* getAddressInfo(char *hostName, char *portNumber)
 	int status; /* Variable to hold status indicator. */
 
 	memset(&hints, 0, sizeof hints); /* Clear out all the fields of hints. Beej's guide says to make sure the structure is empty. */
-	hints.ai_family = AF_INET; /* Specifies IPV4*/
+	hints.ai_family = AF_UNSPEC; /* IPv4 or IPv6, whichever the server has. */
 	hints.ai_socktype = SOCK_STREAM; /* Specifies TCP protocol. */
+	hints.ai_flags = AI_ADDRCONFIG; /* Only families this machine has an address for. */
 
 	/* Calls getaddrinfo on the parameters that we passed in to the program. 
 	** According to Beej's guide, the status should return 0, or there is an error, so we must check for this. 
@@ -63,9 +78,9 @@ struct addrinfo* getAddressInfo(char *hostName, char *portNumber)
 
 /**********************
 **                          int createSocket(struct addrinfo * res)
-** Description: This function creates a socket using the addrinfo pointer, and returns 
-** a socket descriptor integer. 
-
+** Description: This function creates a non-blocking socket using the addrinfo pointer and starts
+** connecting it to that address. Returns the socket descriptor, or -1 if the attempt failed straight
+** away, in which case connectSocket() simply moves on to the next address.
 **********************/
 
 int createSocket(struct addrinfo * res)
@@ -76,64 +91,374 @@ int createSocket(struct addrinfo * res)
 
 	socketDescriptor = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 
-	/* We return the sock descriptor unless it is -1. In that case, we print to stderr and exit. */
-
 	if (socketDescriptor == -1)
 	{
-		fprintf(stderr, "Some error occured while creating the socket.\n");
-		exit(1);
+		return -1;
+	}
+
+	/* Non-blocking, so connect() returns at once and several attempts can run side by side. */
+
+	fcntl(socketDescriptor, F_SETFL, fcntl(socketDescriptor, F_GETFL) | O_NONBLOCK);
+
+	if (connect(socketDescriptor, res->ai_addr, res->ai_addrlen) == -1 && errno != EINPROGRESS)
+	{
+		close(socketDescriptor);
+		return -1;
+	}
+
+	return socketDescriptor;
+}
+
+/**********************
+**                          long long milliseconds(void)
+** Description: Returns the current time in milliseconds, from a clock that never jumps.
+**********************/
+
+long long milliseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**********************
+**          void addressString(struct sockaddr *address, socklen_t length, char *text)
+** Description: Writes the numeric form of address (like 10.0.0.1 or ::1) into text, which holds
+** NI_MAXHOST characters. Used to match addresses against the cache.
+**********************/
+
+void addressString(struct sockaddr *address, socklen_t length, char *text)
+{
+	if (getnameinfo(address, length, text, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0)
+	{
+		text[0] = '\0';
+	}
+}
+
+/**********************
+**          void cachePath(char *path, size_t size)
+** Description: Writes the path of the address cache into path. Leaves it empty if there is no home directory.
+**********************/
+
+void cachePath(char *path, size_t size)
+{
+	char *home = getenv("HOME");
+
+	path[0] = '\0';
+
+	if (home != NULL)
+	{
+		snprintf(path, size, "%s/%s", home, CACHEFILE);
+	}
+}
+
+/**********************
+**          void readCachedAddress(char *hostName, char *portNumber, char *address)
+** Description: Looks up the address that last worked for this server in the cache file. Each line
+** of the file is "hostname port address". Writes the address into address (NI_MAXHOST characters),
+** or leaves it empty if the server is not in the cache.
+**********************/
+
+void readCachedAddress(char *hostName, char *portNumber, char *address)
+{
+	char path[1024], line[1024], host[512], port[32], cached[NI_MAXHOST];
+	FILE *cache;
+
+	address[0] = '\0';
+	cachePath(path, sizeof(path));
+
+	if (path[0] == '\0' || (cache = fopen(path, "r")) == NULL)
+	{
+		return;
+	}
+
+	while (fgets(line, sizeof(line), cache) != NULL)
+	{
+		if (sscanf(line, "%511s %31s %1024s", host, port, cached) == 3 && strcmp(host, hostName) == 0 && strcmp(port, portNumber) == 0)
+		{
+			strcpy(address, cached);
+		}
+	}
+
+	fclose(cache);
+}
+
+/**********************
+**          void cacheAddress(char *hostName, char *portNumber, char *address)
+** Description: Records that address worked for this server. The newest entry goes at the end, and
+** only the last CACHEENTRIES servers are kept. The file is rewritten under a temporary name and
+** renamed, so two clients finishing at once cannot leave half a file behind.
+**********************/
+
+void cacheAddress(char *hostName, char *portNumber, char *address)
+{
+	char path[1024], temporary[1100], host[512], port[32];
+	char lines[CACHEENTRIES][1024];
+	int count = 0, i;
+	FILE *cache;
+
+	cachePath(path, sizeof(path));
+
+	if (path[0] == '\0' || strchr(hostName, ' ') != NULL)
+	{
+		return;
+	}
+
+	/* Keep the other servers' entries, oldest dropping off the front when full. */
+
+	if ((cache = fopen(path, "r")) != NULL)
+	{
+		char line[1024];
+
+		while (fgets(line, sizeof(line), cache) != NULL)
+		{
+			if (sscanf(line, "%511s %31s", host, port) != 2 || (strcmp(host, hostName) == 0 && strcmp(port, portNumber) == 0))
+			{
+				continue;
+			}
+
+			if (count == CACHEENTRIES - 1)
+			{
+				memmove(lines[0], lines[1], sizeof(lines[0]) * (CACHEENTRIES - 2));
+				count--;
+			}
+
+			strcpy(lines[count++], line);
+		}
+
+		fclose(cache);
+	}
+
+	snprintf(temporary, sizeof(temporary), "%s.%d", path, (int) getpid());
+
+	if ((cache = fopen(temporary, "w")) == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		fputs(lines[i], cache);
+	}
+
+	fprintf(cache, "%s %s %s\n", hostName, portNumber, address);
+
+	if (fclose(cache) != 0 || rename(temporary, path) != 0)
+	{
+		unlink(temporary);
+	}
+}
+
+/**********************
+**    int orderAddresses(struct addrinfo *res, struct addrinfo **ordered, char *cached)
+** Description: Puts the addresses from getAddressInfo() in the order connectSocket() tries them.
+** The address that worked last time (cached) goes first. The rest alternate between families,
+** starting with the family getaddrinfo() preferred, so one broken family (say IPv6 that goes
+** nowhere) only ever delays us by one stagger. Returns the number of addresses, at most MAXADDRESSES.
+**********************/
+
+int orderAddresses(struct addrinfo *res, struct addrinfo **ordered, char *cached)
+{
+	struct addrinfo *first[MAXADDRESSES], *second[MAXADDRESSES];
+	int firstCount = 0, secondCount = 0, count = 0, i;
+	int preferred = -1;
+	char text[NI_MAXHOST];
+
+	for (; res != NULL && count < MAXADDRESSES; res = res->ai_next)
+	{
+		addressString(res->ai_addr, res->ai_addrlen, text);
+
+		if (cached[0] != '\0' && strcmp(text, cached) == 0 && count == 0)
+		{
+			ordered[count++] = res;
+			continue;
+		}
+
+		if (preferred == -1)
+		{
+			preferred = res->ai_family;
+		}
+
+		if (res->ai_family == preferred && firstCount < MAXADDRESSES)
+		{
+			first[firstCount++] = res;
+		}
+
+		else if (secondCount < MAXADDRESSES)
+		{
+			second[secondCount++] = res;
+		}
 	}
 
-	else
+	for (i = 0; count < MAXADDRESSES && (i < firstCount || i < secondCount); i++)
 	{
-		return socketDescriptor;
+		if (i < firstCount)
+		{
+			ordered[count++] = first[i];
+		}
+
+		if (i < secondCount && count < MAXADDRESSES)
+		{
+			ordered[count++] = second[i];
+		}
 	}
+
+	return count;
 }
 	
 /**********************
-**                          void connectSocket(int sockDescriptor, struct addrinfo * res)
-** Description: This function connects a socket to the server using the sockDescriptor from createSocket() and 
-** the address information from getAddressInfo().
+**   int connectSocket(struct addrinfo * res, char *hostName, char *portNumber, int timeout)
+** Description: This function connects to the server and returns the connected socket descriptor.
+** Rather than waiting on one address at a time, it races them ("Happy Eyeballs"): a new attempt starts
+** every STAGGER milliseconds, or straight away when one fails, and the first one to connect wins. The
+** rest are closed. A slow or unreachable address then costs us STAGGER milliseconds instead of a full
+** TCP timeout. Gives up after timeout seconds. The winning address is cached for next time.
 **********************/
 
-void connectSocket(int socketDescriptor, struct addrinfo * res)
+int connectSocket(struct addrinfo * res, char *hostName, char *portNumber, int timeout)
 {
-	int status; /* integer variable to hold the status header.*/
+	struct addrinfo *ordered[MAXADDRESSES];
+	struct pollfd attempts[MAXADDRESSES];
+	char cached[NI_MAXHOST];
+	int started = 0;   /* Attempts started so far. attempts[0] to attempts[started - 1] are in use. */
+	int running = 0;   /* Attempts still waiting to connect. */
+	int winner = -1;   /* Index of the attempt that connected. */
+	int i;
+
+	readCachedAddress(hostName, portNumber, cached);
+	int count = orderAddresses(res, ordered, cached);
+
+	long long deadline = milliseconds() + (long long) timeout * 1000;
+	long long nextStart = milliseconds();
+
+	while (winner == -1 && milliseconds() < deadline)
+	{
+		long long now = milliseconds();
+
+		/* Start the next attempt if its turn has come, or if nothing else is running. */
+
+		if (started < count && (now >= nextStart || running == 0))
+		{
+			attempts[started].fd = createSocket(ordered[started]);
+			attempts[started].events = POLLOUT;
+			attempts[started].revents = 0;
+			running += (attempts[started].fd >= 0) ? 1 : 0;
+			started++;
+			nextStart = now + STAGGER;
+			continue;
+		}
+
+		if (running == 0)
+		{
+			break; /* Every address failed. */
+		}
+
+		/* Wait for an attempt to finish, but no longer than the next start or the deadline. poll() skips
+		finished attempts, since their descriptors are set to -1. */
+
+		long long wake = (started < count && nextStart < deadline) ? nextStart : deadline;
 
-	status = connect(socketDescriptor, res->ai_addr, res->ai_addrlen);
+		if (poll(attempts, started, (int) (wake - now)) < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		for (i = 0; i < started && winner == -1; i++)
+		{
+			int error = 0;
+			socklen_t length = sizeof(error);
+
+			if (attempts[i].fd < 0 || attempts[i].revents == 0)
+			{
+				continue;
+			}
+
+			/* The socket is writable once connect() has finished. SO_ERROR says whether it worked. */
+
+			if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0 && !(attempts[i].revents & POLLNVAL))
+			{
+				winner = i;
+			}
+
+			else
+			{
+				close(attempts[i].fd);
+				attempts[i].fd = -1;
+				running--;
+				nextStart = now; /* Don't wait out the stagger for an address that already failed. */
+			}
+		}
+	}
+
+	/* Close the attempts that lost the race. */
 
-	/* We return the sock descriptor unless it is -1. In that case, we print to stderr and exit. */
+	for (i = 0; i < started; i++)
+	{
+		if (i != winner && attempts[i].fd >= 0)
+		{
+			close(attempts[i].fd);
+		}
+	}
 
-	if (status == -1)
+	if (winner == -1)
 	{
-		fprintf(stderr, "Some error occured while connecting socket to server.\n");
+		fprintf(stderr, "Some error occured while connecting socket to server. %s\n", (running > 0) ? "Timed out." : "No address answered.");
 		exit(1);
 	}
+
+	/* The rest of the program expects blocking sends and receives. */
+
+	int socketDescriptor = attempts[winner].fd;
+	char address[NI_MAXHOST];
+
+	fcntl(socketDescriptor, F_SETFL, fcntl(socketDescriptor, F_GETFL) & ~O_NONBLOCK);
+	addressString(ordered[winner]->ai_addr, ordered[winner]->ai_addrlen, address);
+
+	if (address[0] != '\0')
+	{
+		cacheAddress(hostName, portNumber, address);
+	}
+
+	return socketDescriptor;
 }
 
 /**********************
-**                  void exchangeHandles(int socketDescriptor, char * clientname, char *servername)
+**                  void exchangeHandles(struct frameReader *reader, char * clientname, char *servername)
 ** Description: This function sends our clientname to the server, and recieves the servername from the server.
+** Both handles travel as frames, so the servername arrives whole even if TCP splits it up.
 **********************/
 
-void exchangeHandles(int socketDescriptor, char * clientname, char * servername)
+void exchangeHandles(struct frameReader *reader, char * clientname, char * servername)
 {
-	/* Send clientname to server.*/
+	uint32_t size;
+
+	/* Send clientname to server. Header and handle go out in one write. */
 
-	int sendMessage = send(socketDescriptor, clientname, strlen(clientname), 0); /* send(socket file descriptor, buffer of what to send, length, flags) */
+	if (sendFrame(reader->sockDescriptor, clientname, strlen(clientname)) != 0)
+	{
+		fprintf(stderr, "Error occured while sending handle to server.\n");
+		exit(1);
+	}
 
-	/* Recieve servername from server. */
+	/* Recieve servername from server. servername holds 10 characters, so longer handles are refused. */
 
-	int recieveMessage = recv(socketDescriptor, servername, 10, 0); /* recv (socket file descriptor, buffer to store recieved message, length, flags) */
+	if (receiveFrame(reader, servername, 10, &size) != 0)
+	{
+		fprintf(stderr, "Error occured while recieving handle from server.\n");
+		exit(1);
+	}
 }
 
 /**********************
-**                      void chat(int socketDescriptor, char * clientname, char *servername)
+**                      void chat(struct frameReader *reader, char * clientname, char *servername)
 ** Description: This function facillitates a conversation between the client and the server in a while loop. 
+** Messages are framed, so each recieve returns exactly one message from the server.
 **********************/
 
-void chat(int socketDescriptor, char * clientname, char *servername)
+void chat(struct frameReader *reader, char * clientname, char *servername)
 {
+	int socketDescriptor = reader->sockDescriptor;
+
 	/* Create buffers to store the sent and recieve messages. Their values will be reset at the end of each while loop.*/
 	char sendMessage[503];
 	char recieveMessage[501];
@@ -144,12 +469,14 @@ void chat(int socketDescriptor, char * clientname, char *servername)
 	memset(recieveMessage, 0, sizeof(recieveMessage));
 
 	/* We can create two error handlers here. One for send and for for recieve.*/
-	/* send() returns the number of bytes that are actually sent, so we can compare that to -1. */
-	/* recv() also returns the number of bytes returned to the buffer, but it also can say 0 to indicate the server is closed.*/
+	/* sendFrame() returns -1 if the message could not be sent. */
+	/* receiveFrameTruncated() also returns -1 on errors, but it can return FRAME_CLOSED to indicate the server is closed.*/
+	/* A message longer than our buffer is cut short rather than treated as an error, so one long line from the server does not end the chat.*/
 	/* We need to create a separate error handler for this. */
 
-	int bytesSent;
-	int bytesRecieved;
+	int sendStatus;
+	int recieveStatus;
+	uint32_t size;
 
 	fgets(sendMessage, 500, stdin); // Use fgets to clear newlines from standard input. 
 
@@ -170,24 +497,24 @@ void chat(int socketDescriptor, char * clientname, char *servername)
 
 		else
 		{
-			bytesSent = send(socketDescriptor, sendMessage, strlen(sendMessage), 0); // If \quit was not entered, send the message we stored earlier.
+			sendStatus = sendFrame(socketDescriptor, sendMessage, strlen(sendMessage)); // If \quit was not entered, send the message we stored earlier.
 		}
 
-		if (bytesSent == -1) /* If there was an error sending the message, indicate as such. */
+		if (sendStatus == -1) /* If there was an error sending the message, indicate as such. */
 		{
 			fprintf(stderr, "Error occured while sending message to server.\n");
 			exit(1);
 		}
 
-		bytesRecieved = recv(socketDescriptor, recieveMessage, 500, 0);
+		recieveStatus = receiveFrameTruncated(reader, recieveMessage, sizeof(recieveMessage), &size);
 
-		if (bytesRecieved == -1) /* If there was an error recieving the message, indicate as such.*/
+		if (recieveStatus == -1) /* If there was an error recieving the message, indicate as such.*/
 		{
 			fprintf(stderr, "Error occured while recieving message froms erver.\n");
 			exit(1);
 		}
 
-		else if (bytesRecieved == 0) /*I If the server closed the connection, indicate as such.*/
+		else if (recieveStatus == FRAME_CLOSED) /*I If the server closed the connection, indicate as such.*/
 
 		{
 			printf("Server closed connection.\n");
@@ -198,6 +525,11 @@ void chat(int socketDescriptor, char * clientname, char *servername)
 
 		{
 			printf("%s> %s\n", servername, recieveMessage);
+
+			if (size >= sizeof(recieveMessage))
+			{
+				printf("(Message was %u characters long. Only the first %u were shown.)\n", (unsigned) size, (unsigned) sizeof(recieveMessage) - 1);
+			}
 		}
 
 		/* Clear out the buffers to prepare for the next send and recieve messages. */
@@ -213,31 +545,51 @@ void chat(int socketDescriptor, char * clientname, char *servername)
 
 int main(int argc, char *argv[])
 {
-	if (argc != 3)
+	int timeout = CONNECTTIMEOUT; /* Seconds to keep trying to connect. */
+	int option;
+
+	/* -t [SECONDS] is the only option, and comes before the hostname. */
+
+	while ((option = getopt(argc, argv, "t:")) != -1)
+	{
+		if (option == 't' && atoi(optarg) > 0)
+		{
+			timeout = atoi(optarg);
+		}
+
+		else
+		{
+			fprintf(stderr, "Invald syntax.\nUsage:<program_name> [-t seconds] <host_name> <port_number>\n\n");
+			exit(1);
+		}
+	}
+
+	if (argc - optind != 2)
 	{
-		fprintf(stderr, "Invald syntax.\nUsage:<program_name> <host_name> <port_number>\n\n");
+		fprintf(stderr, "Invald syntax.\nUsage:<program_name> [-t seconds] <host_name> <port_number>\n\n");
 		exit(1);
 	}
 
 	char clientname[10];
 	char servername[10];
 	int socketDescriptor;
+	struct frameReader reader; /* Buffered reader for messages from the server. */
 	getClientName(clientname);
 
-	struct addrinfo * res = getAddressInfo(argv[1], argv[2]); /* Call the address info function using the hostname and the port number.*/
+	struct addrinfo * res = getAddressInfo(argv[optind], argv[optind + 1]); /* Call the address info function using the hostname and the port number.*/
 
-	socketDescriptor = createSocket(res); // Create socket using the information from the address info function. 
+	/* Race connections to every address of the server and keep the first that connects. */
+	socketDescriptor = connectSocket(res, argv[optind], argv[optind + 1], timeout);
 
-	/* Connects the socket to the server. */
-	connectSocket(socketDescriptor, res);
+	initReader(&reader, socketDescriptor);
 
 	/* Exchange information so both the client and server know each others names. */
 
-	exchangeHandles(socketDescriptor, clientname, servername);
+	exchangeHandles(&reader, clientname, servername);
 
 	/* Begin the while loop between the serve and the client that will continue until one of them closes the connection. */
 
-	chat(socketDescriptor, clientname, servername);
+	chat(&reader, clientname, servername);
 
 	freeaddrinfo(res); /* Free up the memory of the linked list to prevent memory links.*/
 }
\ No newline at end of file
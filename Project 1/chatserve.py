@@ -6,15 +6,60 @@ Date: February 15, 2017
 '''
 
 from socket import *
+from struct import *
 import sys
 
+MESSAGELENGTH = 500 # Longest message we send, to match the client's buffer.
+
+# Messages are framed the same way as common/framing.c: a 4 byte size in network
+# byte order followed by the message itself.
+
+def sendFrame(connection, message):
+    
+    connection.sendall(pack('!I', len(message)) + message) # Size and message in one write.
+
+def receiveExact(connection, size):
+    
+    # recv can return less than we ask for, so keep going until size bytes have arrived.
+    # Returns an empty string if the client closed the connection.
+    
+    data = ""
+    
+    while len(data) < size:
+        piece = connection.recv(size - len(data))
+        
+        if (piece == ""):
+            return ""
+        
+        data += piece
+    
+    return data
+
+def receiveFrame(connection):
+    
+    # Returns None if the client closed the connection.
+    
+    header = receiveExact(connection, 4)
+    
+    if (header == ""):
+        return None
+    
+    size = unpack('!I', header)[0]
+    
+    if (size == 0):
+        return ""
+    
+    message = receiveExact(connection, size)
+    
+    return message if (message != "") else None
+
 def exchangeHandles(connection, serverName):
     
     # Exchange handles with the incoming client. 
     
-    clientName = connection.recv(1000) # Get clientname. 
+    clientName = receiveFrame(connection) # Get clientname. 
     
-    connection.send(serverName) # Send our server handle to 
+    sendFrame(connection, serverName) # Send our server handle to 
     
     return clientName # Return the clientName to main.
     
@@ -25,12 +70,14 @@ def chatWithClient(connection, serverName, clientName):
     sendMessage = ""
     
     while True:
-        recieveMessage = connection.recv(500)[0:-1] # Recieve message from client. 
+        recieveMessage = receiveFrame(connection) # Recieve message from client. 
         
-        if (recieveMessage == ""): # If nothing is recieved, close the connection.
+        if (recieveMessage is None): # If nothing is recieved, close the connection.
             print("Nothing recieved. Closing connection.")
             break
         
+        recieveMessage = recieveMessage[0:-1] # Drop the newline the client leaves on the end.
+        
         # Print a properly formatted combination of client name and address
         
         print ("{}> {}".format(clientName, recieveMessage))
@@ -38,13 +85,13 @@ def chatWithClient(connection, serverName, clientName):
         
     # Read message from server user to respond to client. 
         
-        sendMessage = raw_input("{}> ".format(serverName))
+        sendMessage = raw_input("{}> ".format(serverName))[0:MESSAGELENGTH] # The client holds at most 500 characters.
         
         if sendMessage == "\quit":
             print("\quit entered. Closing connection.")
             break
         
-        connection.send(sendMessage)
+        sendFrame(connection, sendMessage)
         
 # Defines the main function. 
     
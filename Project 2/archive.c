@@ -0,0 +1,199 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Reading packed file archives. See archive.h for the layout. Writing them is
+** ftpack.c's job.
+***********************/
+
+#define _GNU_SOURCE /* memfd_create() and file sealing. */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "../common/framing.h"
+
+struct archive
+{
+	const char *base;
+	uint64_t size;
+	const struct archiveHeader *header;
+	const uint32_t *buckets;
+	const struct archiveEntry *entries;
+	const char *names;
+	const char *listing;
+};
+
+/* FNV-1a over the name, started from the seed, then mixed so that nearby seeds give unrelated
+slots. The mix is the finalizer from MurmurHash3. */
+
+uint32_t archiveHash(const char *name, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+
+	while (*name != '\0')
+	{
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/* Is the region [offset, offset + length) inside the archive? */
+
+static int inside(struct archive *archive, uint64_t offset, uint64_t length)
+{
+	return offset <= archive->size && length <= archive->size - offset;
+}
+
+/* Check every offset in the archive once, so lookups can trust them. */
+
+static int validArchive(struct archive *archive)
+{
+	const struct archiveHeader *header = archive->header;
+	uint64_t namesSize;
+	uint32_t i;
+
+	if (archive->size < sizeof(*header) || memcmp(header->magic, ARCHIVE_MAGIC, ARCHIVE_MAGICLENGTH) != 0
+		|| header->byteOrder != ARCHIVE_BYTEORDER || header->totalSize != archive->size
+		|| (header->fileCount > 0 && header->bucketCount == 0))
+	{
+		return 0;
+	}
+
+	if (!inside(archive, header->bucketsOffset, (uint64_t) header->bucketCount * sizeof(uint32_t))
+		|| !inside(archive, header->entriesOffset, (uint64_t) header->fileCount * sizeof(struct archiveEntry))
+		|| header->entriesOffset % sizeof(uint64_t) != 0 || header->bucketsOffset % sizeof(uint32_t) != 0
+		|| header->namesOffset > header->listingOffset
+		|| !inside(archive, header->listingOffset, (uint64_t) header->listingLength + 1)
+		|| archive->base[header->listingOffset + header->listingLength] != '\0')
+	{
+		return 0;
+	}
+
+	namesSize = header->listingOffset - header->namesOffset;
+
+	for (i = 0; i < header->fileCount; i++)
+	{
+		const struct archiveEntry *entry = &archive->entries[i];
+
+		if (!inside(archive, entry->offset, entry->size) || entry->size > UINT32_MAX
+			|| (uint64_t) entry->nameOffset + entry->nameLength >= namesSize
+			|| archive->names[entry->nameOffset + entry->nameLength] != '\0')
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+struct archive *openArchive(const char *path)
+{
+	struct stat info;
+	struct archive *archive;
+	int fileDescriptor = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fileDescriptor < 0)
+	{
+		return NULL;
+	}
+
+	archive = calloc(1, sizeof(*archive));
+
+	if (archive == NULL || fstat(fileDescriptor, &info) < 0 || info.st_size < (off_t) sizeof(struct archiveHeader))
+	{
+		free(archive);
+		close(fileDescriptor);
+		return NULL;
+	}
+
+	/* The mapping keeps the file alive, so the descriptor can go right away. */
+
+	archive->size = info.st_size;
+	archive->base = mmap(NULL, archive->size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+	close(fileDescriptor);
+
+	if (archive->base == MAP_FAILED)
+	{
+		free(archive);
+		return NULL;
+	}
+
+	archive->header = (const struct archiveHeader *) archive->base;
+	archive->buckets = (const uint32_t *) (archive->base + archive->header->bucketsOffset);
+	archive->entries = (const struct archiveEntry *) (archive->base + archive->header->entriesOffset);
+	archive->names = archive->base + archive->header->namesOffset;
+	archive->listing = archive->base + archive->header->listingOffset;
+
+	if (!validArchive(archive))
+	{
+		munmap((void *) archive->base, archive->size);
+		free(archive);
+		return NULL;
+	}
+
+	return archive;
+}
+
+int findArchiveFile(struct archive *archive, const char *name, const char **contents, uint64_t *size)
+{
+	const struct archiveHeader *header = archive->header;
+
+	if (header->fileCount == 0)
+	{
+		return 0;
+	}
+
+	uint32_t displacement = archive->buckets[archiveHash(name, 0) % header->bucketCount];
+	const struct archiveEntry *entry = &archive->entries[archiveHash(name, displacement) % header->fileCount];
+
+	if (strcmp(archive->names + entry->nameOffset, name) != 0)
+	{
+		return 0;
+	}
+
+	*contents = archive->base + entry->offset;
+	*size = entry->size;
+	return 1;
+}
+
+const char *archiveListing(struct archive *archive, uint32_t *length)
+{
+	*length = archive->header->listingLength;
+	return archive->listing;
+}
+
+uint32_t archiveFileCount(struct archive *archive)
+{
+	return archive->header->fileCount;
+}
+
+int archiveDescriptor(const char *contents, uint64_t size)
+{
+	int fileDescriptor = memfd_create("ftarchive", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	if (fileDescriptor < 0)
+	{
+		return -1;
+	}
+
+	/* Seal it so the client can only read what we wrote. */
+
+	if (sendAll(fileDescriptor, contents, size) < 0
+		|| fcntl(fileDescriptor, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+	{
+		close(fileDescriptor);
+		return -1;
+	}
+
+	return fileDescriptor;
+}
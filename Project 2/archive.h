@@ -0,0 +1,86 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Packed file archives for ftserver. ftpack packs the regular files of a directory
+** into one archive file, and ftserver -a maps it read-only once at startup and serves every -l
+** and -g from the mapping. There is no opendir(), readdir() or open() per request: a -g is one
+** hash lookup and a send straight out of the mapping, and the listing is stored prebuilt.
+**
+** File layout, all in the byte order of the machine that packed it:
+**   header   - struct archiveHeader.
+**   buckets  - bucketCount uint32_t displacements for the perfect hash.
+**   entries  - fileCount struct archiveEntry, one per hash slot.
+**   names    - the filenames, each NUL terminated.
+**   listing  - the -l listing, "[name] " for every file in directory order, NUL terminated.
+**   data     - file contents, each starting on an ARCHIVE_ALIGN boundary, in directory order so
+**              that fetching files in listing order reads the archive front to back.
+**
+** The name index is a minimal perfect hash (hash and displace): a name's bucket is
+** archiveHash(name, 0) % bucketCount, and its slot is archiveHash(name, displacement of the
+** bucket) % fileCount. ftpack picks displacements so that every file gets its own slot, with no
+** empty slots. A name that is not in the archive still lands on some slot, so lookups compare the
+** stored name before answering.
+***********************/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#define ARCHIVE_MAGIC "FTPACK01"
+#define ARCHIVE_MAGICLENGTH 8
+
+/* Written as a number, so an archive moved to a machine with the other byte order is refused. */
+#define ARCHIVE_BYTEORDER 0x01020304u
+
+/* File contents start on cache line boundaries. */
+#define ARCHIVE_ALIGN 64
+
+/* Average files per hash bucket. Bigger buckets mean a smaller index but a slower ftpack. */
+#define ARCHIVE_BUCKETSIZE 4
+
+struct archiveHeader
+{
+	char magic[ARCHIVE_MAGICLENGTH];
+	uint32_t byteOrder;
+	uint32_t fileCount;
+	uint32_t bucketCount;
+	uint32_t listingLength;  /* Not counting the terminator. */
+	uint64_t bucketsOffset;
+	uint64_t entriesOffset;
+	uint64_t namesOffset;
+	uint64_t listingOffset;
+	uint64_t dataOffset;
+	uint64_t totalSize;      /* Size of the whole archive, to catch truncated files. */
+};
+
+struct archiveEntry
+{
+	uint64_t offset;      /* Of the contents, from the start of the archive. */
+	uint64_t size;        /* Of the contents. Never more than UINT32_MAX, the largest frame. */
+	uint32_t nameOffset;  /* From the start of the names. */
+	uint32_t nameLength;  /* Not counting the terminator. */
+};
+
+struct archive;
+
+/* Hash used by the index. ftpack and the server must agree on it. */
+uint32_t archiveHash(const char *name, uint32_t seed);
+
+/* Map the archive at path read-only and check it. Returns NULL if it cannot be read or is not a
+valid archive. The mapping is shared by every session forked after this. */
+struct archive *openArchive(const char *path);
+
+/* Look up name. Returns 1 and points contents and size at the file's bytes in the mapping if it is
+in the archive, 0 otherwise. */
+int findArchiveFile(struct archive *archive, const char *name, const char **contents, uint64_t *size);
+
+/* The prebuilt -l listing, NUL terminated, and its length. */
+const char *archiveListing(struct archive *archive, uint32_t *length);
+
+uint32_t archiveFileCount(struct archive *archive);
+
+/* Copy size bytes into a new sealed, read-only memory file and return its descriptor, or -1. Local
+clients expect a descriptor for -g, and a file inside the archive has none of its own. */
+int archiveDescriptor(const char *contents, uint64_t size);
+
+#endif
@@ -0,0 +1,225 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Implementation of the shared buffer pool. See bufferpool.h.
+**
+** Two shared mappings are made. The first holds the bookkeeping: a semaphore counting free
+** buffers, a robust mutex, a stack of free buffer indexes, and the pid holding each buffer. The
+** second holds the buffers themselves, so it can use huge pages without the bookkeeping.
+***********************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "bufferpool.h"
+
+/* Buffers start on cache line boundaries so two sessions never share a line. */
+#define CACHELINE 64
+
+/* Huge pages are 2 MB on the machines we run on. */
+#define HUGEPAGE (2 * 1024 * 1024)
+
+/* Bookkeeping at the start of the first mapping. freeList and owner each have count entries
+and follow the structure in memory. */
+
+struct poolHeader
+{
+	sem_t available;
+	pthread_mutex_t lock;
+	size_t bufferSize;
+	int count;
+	int freeTop;
+};
+
+struct bufferPool
+{
+	struct poolHeader *header;
+	int *freeList;
+	pid_t *owner;
+	char *buffers;
+	size_t headerBytes;
+	size_t bufferBytes;
+};
+
+/* Round size up to a multiple of unit. */
+
+static size_t roundUp(size_t size, size_t unit)
+{
+	return (size + unit - 1) / unit * unit;
+}
+
+/* Lock the free list. If a session died while holding the lock, mark the mutex usable and carry
+on. The updates below are ordered so that dying part way through can at worst lose one buffer,
+never hand the same buffer out twice. */
+
+static void lockPool(struct bufferPool *pool)
+{
+	if (pthread_mutex_lock(&pool->header->lock) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&pool->header->lock);
+	}
+}
+
+struct bufferPool *createPool(size_t bufferSize, size_t totalBytes, int hugePages)
+{
+	struct bufferPool *pool;
+	pthread_mutexattr_t attributes;
+	int count;
+	int i;
+
+	bufferSize = roundUp(bufferSize, CACHELINE);
+	count = (int) (totalBytes / bufferSize);
+
+	if (bufferSize == 0 || count < 1)
+	{
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+
+	pool->headerBytes = sizeof(struct poolHeader) + count * (sizeof(int) + sizeof(pid_t));
+	pool->header = mmap(NULL, pool->headerBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (pool->header == MAP_FAILED)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	pool->freeList = (int *) (pool->header + 1);
+	pool->owner = (pid_t *) (pool->freeList + count);
+
+	/* Try huge pages first if asked, then fall back to normal pages. */
+
+	pool->buffers = MAP_FAILED;
+
+	if (hugePages)
+	{
+		pool->bufferBytes = roundUp(count * bufferSize, HUGEPAGE);
+		pool->buffers = mmap(NULL, pool->bufferBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+
+	if (pool->buffers == MAP_FAILED)
+	{
+		pool->bufferBytes = count * bufferSize;
+		pool->buffers = mmap(NULL, pool->bufferBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (pool->buffers == MAP_FAILED)
+	{
+		munmap(pool->header, pool->headerBytes);
+		free(pool);
+		return NULL;
+	}
+
+	pool->header->bufferSize = bufferSize;
+	pool->header->count = count;
+	pool->header->freeTop = count;
+
+	for (i = 0; i < count; i++)
+	{
+		pool->freeList[i] = i;
+		pool->owner[i] = 0;
+	}
+
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&pool->header->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+
+	sem_init(&pool->header->available, 1, count);
+
+	return pool;
+}
+
+char *borrowBuffer(struct bufferPool *pool)
+{
+	int index;
+
+	/* The semaphore counts free buffers, so once we are past it one is guaranteed to be there. */
+
+	while (sem_wait(&pool->header->available) < 0)
+	{
+		if (errno != EINTR)
+		{
+			return NULL;
+		}
+	}
+
+	lockPool(pool);
+	index = pool->freeList[pool->header->freeTop - 1];
+	pool->header->freeTop--;
+	pool->owner[index] = getpid();
+	pthread_mutex_unlock(&pool->header->lock);
+
+	return pool->buffers + index * pool->header->bufferSize;
+}
+
+/* Push index back on the free list and wake one waiting session. Caller holds the lock. */
+
+static void releaseIndex(struct bufferPool *pool, int index)
+{
+	pool->owner[index] = 0;
+	pool->freeList[pool->header->freeTop] = index;
+	pool->header->freeTop++;
+	sem_post(&pool->header->available);
+}
+
+void returnBuffer(struct bufferPool *pool, char *buffer)
+{
+	int index = (int) ((buffer - pool->buffers) / pool->header->bufferSize);
+
+	lockPool(pool);
+
+	if (pool->owner[index] != 0)
+	{
+		releaseIndex(pool, index);
+	}
+
+	pthread_mutex_unlock(&pool->header->lock);
+}
+
+int reclaimBuffers(struct bufferPool *pool)
+{
+	int reclaimed = 0;
+	int i;
+
+	lockPool(pool);
+
+	for (i = 0; i < pool->header->count; i++)
+	{
+		/* kill() with signal 0 only checks whether the process still exists. */
+
+		if (pool->owner[i] != 0 && kill(pool->owner[i], 0) < 0 && errno == ESRCH)
+		{
+			releaseIndex(pool, i);
+			reclaimed++;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->header->lock);
+	return reclaimed;
+}
+
+size_t poolBufferSize(struct bufferPool *pool)
+{
+	return pool->header->bufferSize;
+}
+
+int poolBufferCount(struct bufferPool *pool)
+{
+	return pool->header->count;
+}
@@ -0,0 +1,36 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: A fixed pool of I/O buffers shared by every ftserver session. ftserver forks a
+** child per connection, so the pool lives in shared memory mapped before the first fork, and the
+** free list is guarded by a process-shared semaphore and mutex. A session borrows one buffer for
+** its whole life and gives it back before exiting. When every buffer is out, new sessions wait
+** instead of allocating, so memory use never grows past what the pool was created with.
+***********************/
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stddef.h>
+
+struct bufferPool;
+
+/* Map a pool of bufferSize byte buffers using at most totalBytes of memory. bufferSize is rounded
+up to a multiple of the cache line size. With hugePages set, the buffers are backed by huge pages
+when the system has them, and by normal pages otherwise. Returns NULL on failure. */
+struct bufferPool *createPool(size_t bufferSize, size_t totalBytes, int hugePages);
+
+/* Take a buffer from the pool, waiting until one is free. Returns NULL only on error. */
+char *borrowBuffer(struct bufferPool *pool);
+
+/* Give a buffer back to the pool. */
+void returnBuffer(struct bufferPool *pool, char *buffer);
+
+/* Give back buffers still held by sessions that have exited without returning them.
+Called by the parent process after children exit. Returns the number reclaimed. */
+int reclaimBuffers(struct bufferPool *pool);
+
+/* Size of each buffer, and number of buffers in the pool. */
+size_t poolBufferSize(struct bufferPool *pool);
+int poolBufferCount(struct bufferPool *pool);
+
+#endif
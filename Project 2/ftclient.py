@@ -65,9 +65,9 @@ def connectToServer(hostname, port):
 # Packing can be found in the struct python documentation.
 
 # Takes socket file descriptor and message to be sent. Will send the size of the message
-# and then the message. All of the following functions use the same general exception 
-# format. That is, printing that there is an error, closing the file descriptor,
-# and then exiting.
+# and then the message as one frame, matching common/framing.c on the server. All of the following
+# functions use the same general exception format. That is, printing that there is an error,
+# closing the file descriptor, and then exiting.
 
 def sendMessage(sockDescriptor, message):
     
@@ -75,10 +75,10 @@ def sendMessage(sockDescriptor, message):
     
     try:
         # Formatting information can be find in struct documentation 7.3.2.2 - Format Characters
+        # '!' selects network byte order so the size means the same thing on every machine.
         
-        packedData = pack('I', size) # Pack the size of the message in the format of unsigned integer. 
-        sockDescriptor.send(packedData) # Send the size of the message.
-        sockDescriptor.send(message) # Send the message
+        packedData = pack('!I', size) # Pack the size of the message in the format of unsigned integer. 
+        sockDescriptor.sendall(packedData + message) # Send the size and the message in one write.
     
     # If there is an error, print there is an error, close the socket, and exit. 
     except: 
@@ -86,14 +86,31 @@ def sendMessage(sockDescriptor, message):
         sockDescriptor.close()
         sys.exit(1)
 
+# Takes socket file descriptor and a byte count. recv can return fewer bytes than asked for,
+# so keep reading until all of them have arrived. Raises an exception if the connection closes early.
+
+def receiveExact(sockDescriptor, size):
+    pieces = []
+    
+    while size > 0:
+        piece = sockDescriptor.recv(min(size, 65536))
+        
+        if piece == "":
+            raise EOFError("Connection closed in the middle of a message.")
+        
+        pieces.append(piece)
+        size -= len(piece)
+    
+    return "".join(pieces)
+
 # Takes socket file descriptor and receives the message. Message is returned if successful.
 # Otherwise, the program exits.
 
 def receiveMessage(sockDescriptor):
     try:
-        sizeData = sockDescriptor.recv(4) # Get size of message to be receive
-        size = unpack('I', sizeData) # Unpack size data to get size in unsigned integer format.
-        message = sockDescriptor.recv(size[0]) # Receive the message itself
+        sizeData = receiveExact(sockDescriptor, 4) # Get size of message to be receive
+        size = unpack('!I', sizeData) # Unpack size data to get size in unsigned integer format.
+        message = receiveExact(sockDescriptor, size[0]) # Receive the message itself
         return message # Return the message
     
     except:
@@ -105,8 +122,8 @@ def receiveMessage(sockDescriptor):
 
 def sendPortNumber(sockDescriptor, port):
     try:
-        portData = pack('I', port) # Pack to prepare the sending of the port number in unsigned integer format
-        sockDescriptor.send(portData) # Send the data which contains the port number.
+        portData = pack('!I', port) # Pack to prepare the sending of the port number in unsigned integer format
+        sockDescriptor.sendall(portData) # Send the data which contains the port number.
     
     except:
         print("Error with sending port number.")
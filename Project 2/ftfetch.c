@@ -0,0 +1,99 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: ftfetch, a small command line front end for ftlib. Fetches any number of files
+** from ftserver at once, or prints the directory listing, from a single thread.
+**
+** Proper syntax: ftfetch [HOSTNAME] [SERVER PORT] [FIRST DATA PORT] [-l | FILENAME...]
+**            or: ftfetch -u [SOCKET PATH] [-l | FILENAME...]
+** Data ports FIRST DATA PORT up to FIRST DATA PORT + 63 are used, one per file in flight.
+** The second form talks to a server on this machine started with ftserver -u [SOCKET PATH].
+***********************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "ftlib.h"
+
+/* How many requests to keep in flight, and so how many data ports to use. */
+#define CONCURRENCY 64
+
+/* Count of requests that did not complete successfully. */
+static int failures = 0;
+
+/* Completion callback. Print the listing, or one line per file. */
+
+void printResult(const struct ftResult *result, void *context)
+{
+	(void) context;
+
+	if (result->status != FT_OK)
+	{
+		fprintf(stderr, "%s: %s\n", result->filename ? result->filename : "-l", result->message);
+		failures++;
+	}
+
+	else if (result->command == FT_LIST)
+	{
+		printf("%s\n", result->message);
+	}
+
+	else
+	{
+		printf("[%s] %llu bytes in %.3f seconds\n", result->filename, (unsigned long long) result->bytes, result->seconds);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int first; /* Index of the first -l or filename argument. */
+	struct ftClient *client;
+
+	if (argc >= 4 && strcmp(argv[1], "-u") == 0)
+	{
+		client = ftCreateLocalClient(argv[2], CONCURRENCY);
+		first = 3;
+	}
+
+	else if (argc >= 5)
+	{
+		client = ftCreateClient(argv[1], atoi(argv[2]), atoi(argv[3]), CONCURRENCY);
+		first = 4;
+	}
+
+	else
+	{
+		fprintf(stderr, "Invalid number of arguments. Usage: [PROGRAM NAME] [HOSTNAME] [SERVER PORT] [FIRST DATA PORT] [-l | FILENAME...]\n");
+		fprintf(stderr, "                                 or: [PROGRAM NAME] -u [SOCKET PATH] [-l | FILENAME...]\n\n");
+		exit(1);
+	}
+
+	if (client == NULL)
+	{
+		fprintf(stderr, "Error. Could not set up a client for %s.\n", argv[1]);
+		exit(1);
+	}
+
+	/* Queue everything first. ftlib starts as many as there are data ports and queues the rest. */
+
+	for (i = first; i < argc; i++)
+	{
+		int status = (strcmp(argv[i], "-l") == 0) ? ftList(client, printResult, NULL) : ftGet(client, argv[i], argv[i], printResult, NULL);
+
+		if (status < 0)
+		{
+			fprintf(stderr, "Error. Could not queue request for %s.\n", argv[i]);
+			failures++;
+		}
+	}
+
+	if (ftRun(client) < 0)
+	{
+		fprintf(stderr, "Error in event loop.\n");
+		failures++;
+	}
+
+	ftDestroyClient(client);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,1320 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Implementation of ftlib. See ftlib.h for the interface.
+**
+** Every request walks through the same states:
+**     CONNECT_CONTROL -> SEND_REQUEST -> CONNECT_DATA -> READ_RESPONSE -> READ_PAYLOAD
+** ftserver only starts listening on the data port after it has read the request, so a refused
+** data connection is retried on a short timer instead of being treated as an error. While it
+** retries, the control connection stays watched too, so a server that gives up on the data
+** connection and says so, or hangs up, ends the request instead of leaving it retrying.
+**
+** Local clients talk to ftserver's Unix domain socket and skip CONNECT_DATA. A listing follows the
+** response on the same socket, and a file arrives as a descriptor attached to the "FILE" response.
+***********************/
+
+#define _GNU_SOURCE /* For copy_file_range(). */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "ftlib.h"
+#include "../common/framing.h"
+
+/* Largest filename or command we will put in a request. ftserver reads them into 1024 byte buffers. */
+#define FT_NAMEMAX 1023
+
+/* Server responses on the control connection are short ("DATA" or an error sentence). */
+#define FT_RESPONSEMAX 1024
+
+/* Scratch buffer shared by every request for moving payload bytes from socket to disk. */
+#define FT_SCRATCH 65536
+
+/* Wait between attempts to reach a data port that is not listening yet. Attempts go on until the
+request's deadline, since a busy server may not open the port until one of its buffers frees up. */
+#define FT_RETRYMS 10
+
+/* A request that makes no progress for this many seconds is failed rather than left hanging.
+Refused data connects are not progress. */
+#define FT_TIMEOUT 30
+
+#define FT_EVENTS 256
+
+enum ftState
+{
+	CONNECT_CONTROL,
+	SEND_REQUEST,
+	CONNECT_DATA,
+	READ_RESPONSE,
+	READ_PAYLOAD
+};
+
+/* One request. Requests waiting for a data port sit on the pending list, running requests on the active list. */
+
+struct ftRequest
+{
+	struct ftRequest *next;
+	struct ftRequest *prev;
+
+	int command;
+	char *filename;
+	char *destination;
+	ftCallback callback;
+	void *context;
+
+	enum ftState state;
+	int controlSocket;
+	int dataSocket;
+	int activeSocket;      /* The socket registered through watch(), or -1. In CONNECT_DATA this is the
+	                          control socket, and a data connect in flight is registered as well. */
+	int slot;              /* Index into portInUse while running, -1 otherwise. */
+	int dataPort;
+	double retryAt;        /* Monotonic time of the next connect attempt, 0 if none. */
+	double deadline;       /* Monotonic time after which the request is timed out. */
+	double started;
+
+	char request[2 * (FRAME_HEADER + FT_NAMEMAX) + 8];
+	size_t requestSize;
+	size_t requestSent;
+
+	char response[FT_RESPONSEMAX];
+	size_t responseSize;   /* Bytes of header plus body received so far. */
+
+	char header[FRAME_HEADER];
+	size_t headerSize;
+	uint64_t payloadSize;
+	uint64_t payloadReceived;
+
+	int fileDescriptor;    /* Destination file for -g. */
+	int passedDescriptor;  /* Descriptor received from a local server, or -1. */
+	char *listing;         /* Accumulated listing for -l. */
+};
+
+struct ftClient
+{
+	int local;                     /* Talking to a Unix domain socket instead of TCP. */
+	struct sockaddr_un localServer;
+	struct sockaddr_in server;
+	int epoll;
+	int timer;
+	int firstDataPort;
+	int dataPortCount;
+	char *portInUse;
+	int nextPort;          /* Slot to try first when handing out a data port. */
+
+	struct ftRequest *pendingHead;
+	struct ftRequest *pendingTail;
+	struct ftRequest *active;
+	int outstanding;
+
+	char scratch[FT_SCRATCH];
+};
+
+/* Current monotonic time in seconds. */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Point the epoll registration at fd with the given events, dropping any previous socket. */
+
+static int watch(struct ftClient *client, struct ftRequest *request, int fd, uint32_t events)
+{
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = request;
+
+	if (request->activeSocket == fd)
+	{
+		return epoll_ctl(client->epoll, EPOLL_CTL_MOD, fd, &event);
+	}
+
+	if (request->activeSocket >= 0)
+	{
+		epoll_ctl(client->epoll, EPOLL_CTL_DEL, request->activeSocket, NULL);
+	}
+
+	request->activeSocket = fd;
+	return epoll_ctl(client->epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* The request moved forward, so it gets a fresh FT_TIMEOUT. */
+
+static void progress(struct ftRequest *request)
+{
+	request->deadline = now() + FT_TIMEOUT;
+}
+
+/* Arm the timer for the earliest data connect retry or timeout, or disarm it if nothing is running. */
+
+static void armTimer(struct ftClient *client)
+{
+	struct itimerspec spec;
+	double earliest = 0;
+	struct ftRequest *request;
+
+	for (request = client->active; request != NULL; request = request->next)
+	{
+		double due = (request->retryAt > 0 && request->retryAt < request->deadline) ? request->retryAt : request->deadline;
+
+		if (earliest == 0 || due < earliest)
+		{
+			earliest = due;
+		}
+	}
+
+	memset(&spec, 0, sizeof(spec));
+
+	if (earliest > 0)
+	{
+		double delay = earliest - now();
+
+		if (delay < 0.0001)
+		{
+			delay = 0.0001;
+		}
+
+		spec.it_value.tv_sec = (time_t) delay;
+		spec.it_value.tv_nsec = (long) ((delay - (time_t) delay) * 1e9);
+	}
+
+	timerfd_settime(client->timer, 0, &spec, NULL);
+}
+
+/* Start a non-blocking connect to the server on port (ignored for local servers). Returns the
+socket, or -1 with errno set. */
+
+static int startConnect(struct ftClient *client, int port)
+{
+	struct sockaddr_in address = client->server;
+	int sockDescriptor = socket(client->local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int status;
+
+	if (sockDescriptor < 0)
+	{
+		return -1;
+	}
+
+	/* A local connect never blocks in the kernel: it either completes at once or fails with EAGAIN
+	when the server's backlog is full, and then the caller retries later. */
+
+	if (client->local)
+	{
+		status = connect(sockDescriptor, (struct sockaddr *) &client->localServer, sizeof(client->localServer));
+	}
+
+	else
+	{
+		address.sin_port = htons(port);
+		status = connect(sockDescriptor, (struct sockaddr *) &address, sizeof(address));
+	}
+
+	if (status < 0 && errno != EINPROGRESS)
+	{
+		int error = errno; /* Callers look at errno to decide whether to retry. */
+		close(sockDescriptor);
+		errno = error;
+		return -1;
+	}
+
+	return sockDescriptor;
+}
+
+/* Append a frame to the request buffer. */
+
+static void appendFrame(struct ftRequest *request, const char *payload, uint32_t size)
+{
+	uint32_t header = htonl(size);
+	memcpy(request->request + request->requestSize, &header, FRAME_HEADER);
+	memcpy(request->request + request->requestSize + FRAME_HEADER, payload, size);
+	request->requestSize += FRAME_HEADER + size;
+}
+
+/* Append a bare number in network byte order to the request buffer. */
+
+static void appendNumber(struct ftRequest *request, uint32_t number)
+{
+	uint32_t value = htonl(number);
+	memcpy(request->request + request->requestSize, &value, sizeof(value));
+	request->requestSize += sizeof(value);
+}
+
+/* Unlink request from whichever list it is on. */
+
+static void removeRequest(struct ftRequest **head, struct ftRequest *request)
+{
+	if (request->prev != NULL)
+	{
+		request->prev->next = request->next;
+	}
+	else
+	{
+		*head = request->next;
+	}
+
+	if (request->next != NULL)
+	{
+		request->next->prev = request->prev;
+	}
+
+	request->next = NULL;
+	request->prev = NULL;
+}
+
+/* Release everything a request holds. */
+
+static void freeRequest(struct ftClient *client, struct ftRequest *request)
+{
+	if (request->activeSocket >= 0)
+	{
+		epoll_ctl(client->epoll, EPOLL_CTL_DEL, request->activeSocket, NULL);
+	}
+
+	if (request->controlSocket >= 0)
+	{
+		close(request->controlSocket);
+	}
+
+	if (request->dataSocket >= 0)
+	{
+		close(request->dataSocket);
+	}
+
+	if (request->fileDescriptor >= 0)
+	{
+		close(request->fileDescriptor);
+	}
+
+	if (request->passedDescriptor >= 0)
+	{
+		close(request->passedDescriptor);
+	}
+
+	if (request->slot >= 0)
+	{
+		client->portInUse[request->slot] = 0;
+	}
+
+	free(request->filename);
+	free(request->destination);
+	free(request->listing);
+	free(request);
+}
+
+/* Finish a request: take it off the active list, run its callback, and free it. */
+
+static void finish(struct ftClient *client, struct ftRequest *request, int status, const char *message)
+{
+	struct ftResult result;
+
+	removeRequest(&client->active, request);
+	client->outstanding--;
+
+	if (request->fileDescriptor >= 0)
+	{
+		/* Flush to disk before telling the caller it is there. */
+		if (close(request->fileDescriptor) < 0 && status == FT_OK)
+		{
+			status = FT_ERROR;
+			message = "Error writing file.";
+		}
+		request->fileDescriptor = -1;
+	}
+
+	result.command = request->command;
+	result.status = status;
+	result.filename = request->filename;
+	result.message = message;
+	result.bytes = request->payloadReceived;
+	result.seconds = now() - request->started;
+	result.fileDescriptor = request->passedDescriptor;
+
+	/* Close the sockets and give back the port before the callback, so that a callback
+	queuing new work can start it on this port straight away. */
+
+	if (request->activeSocket >= 0)
+	{
+		epoll_ctl(client->epoll, EPOLL_CTL_DEL, request->activeSocket, NULL);
+		request->activeSocket = -1;
+	}
+
+	if (request->controlSocket >= 0)
+	{
+		close(request->controlSocket);
+		request->controlSocket = -1;
+	}
+
+	if (request->dataSocket >= 0)
+	{
+		close(request->dataSocket);
+		request->dataSocket = -1;
+	}
+
+	if (request->slot >= 0)
+	{
+		client->portInUse[request->slot] = 0;
+		request->slot = -1;
+	}
+
+	if (request->callback != NULL)
+	{
+		request->callback(&result, request->context);
+	}
+
+	freeRequest(client, request);
+}
+
+/* Fail a request with the text of errno. */
+
+static void fail(struct ftClient *client, struct ftRequest *request, const char *what)
+{
+	char message[256];
+	snprintf(message, sizeof(message), "%s: %s", what, strerror(errno));
+	finish(client, request, FT_ERROR, message);
+}
+
+/* After a refused data connect, or a local connect turned away by a full backlog, schedule another
+attempt if the request's deadline allows one. Returns 1 if a retry was scheduled, 0 if the request
+should fail. */
+
+static int scheduleRetry(struct ftRequest *request, int error)
+{
+	double retryAt = now() + FT_RETRYMS / 1000.0;
+
+	if ((error != ECONNREFUSED && error != EAGAIN) || retryAt >= request->deadline)
+	{
+		return 0;
+	}
+
+	request->retryAt = retryAt;
+	return 1;
+}
+
+/* Start the control connection. A local server with a full backlog is tried again later. */
+
+static void connectControl(struct ftClient *client, struct ftRequest *request)
+{
+	request->retryAt = 0;
+	request->controlSocket = startConnect(client, ntohs(client->server.sin_port));
+
+	if (request->controlSocket < 0)
+	{
+		if (errno == EAGAIN && scheduleRetry(request, errno))
+		{
+			return;
+		}
+
+		fail(client, request, "Error connecting to server");
+		return;
+	}
+
+	if (watch(client, request, request->controlSocket, EPOLLOUT) < 0)
+	{
+		fail(client, request, "Error connecting to server");
+	}
+}
+
+/* Move pending requests onto free data ports and start their control connections. */
+
+static void startPending(struct ftClient *client)
+{
+	while (client->pendingHead != NULL)
+	{
+		/* Hand out ports round robin so a port just given back gets time to go quiet on the server. */
+
+		int slot = client->nextPort;
+		int tried = 0;
+
+		while (tried < client->dataPortCount && client->portInUse[slot])
+		{
+			slot = (slot + 1) % client->dataPortCount;
+			tried++;
+		}
+
+		if (tried == client->dataPortCount)
+		{
+			return;
+		}
+
+		client->nextPort = (slot + 1) % client->dataPortCount;
+
+		struct ftRequest *request = client->pendingHead;
+		client->pendingHead = request->next;
+
+		if (client->pendingHead == NULL)
+		{
+			client->pendingTail = NULL;
+		}
+		else
+		{
+			client->pendingHead->prev = NULL;
+		}
+
+		request->next = client->active;
+		request->prev = NULL;
+
+		if (client->active != NULL)
+		{
+			client->active->prev = request;
+		}
+
+		client->active = request;
+
+		client->portInUse[slot] = 1;
+		request->slot = slot;
+		request->dataPort = client->firstDataPort + slot;
+
+		/* Build the whole request up front so it normally leaves in a single write.
+		Local requests have no data port, so they carry only the frames. */
+
+		const char *command = (request->command == FT_GET) ? "-g" : "-l";
+		appendFrame(request, command, 2);
+
+		if (!client->local)
+		{
+			appendNumber(request, request->dataPort);
+		}
+
+		if (request->command == FT_GET)
+		{
+			appendFrame(request, request->filename, strlen(request->filename));
+
+			if (!client->local)
+			{
+				appendNumber(request, request->dataPort);
+			}
+		}
+
+		request->state = CONNECT_CONTROL;
+		request->deadline = now() + FT_TIMEOUT;
+		connectControl(client, request);
+	}
+}
+
+/* Check the result of a non-blocking connect. Returns 0 if connected, otherwise the errno. */
+
+static int connectResult(int sockDescriptor)
+{
+	int error = 0;
+	socklen_t length = sizeof(error);
+
+	if (getsockopt(sockDescriptor, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+	{
+		return errno;
+	}
+
+	return error;
+}
+
+/* A connect to a port nobody is listening on can, on the same machine, pick that very port as its own
+source port and connect to itself. The server then cannot listen there, so treat it as refused. */
+
+static int selfConnected(int sockDescriptor)
+{
+	struct sockaddr_in local, peer;
+	socklen_t localLength = sizeof(local), peerLength = sizeof(peer);
+
+	if (getsockname(sockDescriptor, (struct sockaddr *) &local, &localLength) < 0 || getpeername(sockDescriptor, (struct sockaddr *) &peer, &peerLength) < 0)
+	{
+		return 0;
+	}
+
+	return local.sin_port == peer.sin_port && local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+/* Try the data connection. A refused connect means the server is not listening yet, so retry later.
+The data socket is registered next to the control socket, which stays watched the whole time. */
+
+static void connectData(struct ftClient *client, struct ftRequest *request)
+{
+	struct epoll_event event;
+
+	request->retryAt = 0;
+	request->dataSocket = startConnect(client, request->dataPort);
+
+	if (request->dataSocket < 0)
+	{
+		if (scheduleRetry(request, errno))
+		{
+			return;
+		}
+
+		fail(client, request, "Error connecting data socket");
+		return;
+	}
+
+	event.events = EPOLLOUT;
+	event.data.ptr = request;
+
+	if (epoll_ctl(client->epoll, EPOLL_CTL_ADD, request->dataSocket, &event) < 0)
+	{
+		fail(client, request, "Error connecting data socket");
+	}
+}
+
+/* Stop watching and close a data connect that failed or is no longer wanted. */
+
+static void dropDataSocket(struct ftClient *client, struct ftRequest *request)
+{
+	epoll_ctl(client->epoll, EPOLL_CTL_DEL, request->dataSocket, NULL);
+	close(request->dataSocket);
+	request->dataSocket = -1;
+}
+
+/* Has the server said something, hung up, or failed on the control connection? It only does that
+before the data connection is up when it has given up on it. */
+
+static int controlReadable(struct ftRequest *request)
+{
+	char byte;
+	return recv(request->controlSocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/* Is the non-blocking data connect finished, one way or the other? */
+
+static int connectFinished(int sockDescriptor)
+{
+	struct pollfd check;
+
+	check.fd = sockDescriptor;
+	check.events = POLLOUT;
+	return poll(&check, 1, 0) > 0;
+}
+
+/* The socket the payload arrives on. Local servers send it after the response on the same socket. */
+
+static int payloadSocket(struct ftClient *client, struct ftRequest *request)
+{
+	return client->local ? request->controlSocket : request->dataSocket;
+}
+
+/* A local server answered "FILE" with a descriptor for the file itself. With no destination the
+callback gets the descriptor to read. Otherwise the kernel copies the file to the destination. */
+
+static void receivedFile(struct ftClient *client, struct ftRequest *request)
+{
+	struct stat info;
+	off_t offset = 0;
+
+	if (request->passedDescriptor < 0 || fstat(request->passedDescriptor, &info) < 0)
+	{
+		finish(client, request, FT_ERROR, "Server did not pass a file descriptor.");
+		return;
+	}
+
+	request->payloadSize = info.st_size;
+
+	if (request->destination != NULL)
+	{
+		request->fileDescriptor = open(request->destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (request->fileDescriptor < 0)
+		{
+			fail(client, request, "Error opening destination file");
+			return;
+		}
+
+		/* Explicit offsets, because the descriptor shares its file position with the server's. */
+
+		while (offset < info.st_size)
+		{
+			ssize_t copied = copy_file_range(request->passedDescriptor, &offset, request->fileDescriptor, NULL, info.st_size - offset, 0);
+
+			/* Some kernels and filesystems cannot copy in the kernel. Fall back to reading it ourselves. */
+
+			if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				copied = pread(request->passedDescriptor, client->scratch, FT_SCRATCH, offset);
+
+				if (copied > 0 && sendAll(request->fileDescriptor, client->scratch, copied) < 0)
+				{
+					copied = -1;
+				}
+
+				offset += (copied > 0) ? copied : 0;
+			}
+
+			if (copied <= 0)
+			{
+				fail(client, request, "Error copying file");
+				return;
+			}
+		}
+	}
+
+	request->payloadReceived = info.st_size;
+	finish(client, request, FT_OK, "File received.");
+}
+
+/* Handle the server's answer on the control connection. DATA means the payload follows on
+the data connection. Anything else is an error message for the user. */
+
+static void handleResponse(struct ftClient *client, struct ftRequest *request)
+{
+	if (client->local && strcmp(request->response + FRAME_HEADER, "FILE") == 0)
+	{
+		receivedFile(client, request);
+		return;
+	}
+
+	if (strcmp(request->response + FRAME_HEADER, "DATA") != 0)
+	{
+		finish(client, request, FT_REFUSED, request->response + FRAME_HEADER);
+		return;
+	}
+
+	if (!client->local && request->dataSocket < 0)
+	{
+		finish(client, request, FT_ERROR, "Server answered before the data connection was open.");
+		return;
+	}
+
+	if (request->command == FT_GET)
+	{
+		request->fileDescriptor = open(request->destination, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+		if (request->fileDescriptor < 0)
+		{
+			fail(client, request, "Error opening destination file");
+			return;
+		}
+	}
+
+	request->state = READ_PAYLOAD;
+
+	if (watch(client, request, payloadSocket(client, request), EPOLLIN) < 0)
+	{
+		fail(client, request, "Error waiting for data");
+	}
+}
+
+/* recv() from the control socket, keeping any descriptor a local server attached. */
+
+static ssize_t receiveResponse(struct ftRequest *request, size_t want)
+{
+	struct iovec part;
+	struct msghdr message;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *attached;
+	ssize_t status;
+
+	part.iov_base = request->response + request->responseSize;
+	part.iov_len = want;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	status = recvmsg(request->controlSocket, &message, MSG_CMSG_CLOEXEC);
+
+	for (attached = (status > 0) ? CMSG_FIRSTHDR(&message) : NULL; attached != NULL; attached = CMSG_NXTHDR(&message, attached))
+	{
+		if (attached->cmsg_level == SOL_SOCKET && attached->cmsg_type == SCM_RIGHTS && request->passedDescriptor < 0)
+		{
+			memcpy(&request->passedDescriptor, CMSG_DATA(attached), sizeof(int));
+		}
+	}
+
+	return status;
+}
+
+/* Read as much of the control response as is available. */
+
+static void readResponse(struct ftClient *client, struct ftRequest *request)
+{
+	for (;;)
+	{
+		size_t want;
+
+		if (request->responseSize < FRAME_HEADER)
+		{
+			want = FRAME_HEADER - request->responseSize;
+		}
+		else
+		{
+			uint32_t length;
+			memcpy(&length, request->response, FRAME_HEADER);
+			length = ntohl(length);
+
+			if (length >= FT_RESPONSEMAX - FRAME_HEADER)
+			{
+				finish(client, request, FT_ERROR, "Response from server is too long.");
+				return;
+			}
+
+			want = FRAME_HEADER + length - request->responseSize;
+
+			if (want == 0)
+			{
+				request->response[request->responseSize] = '\0';
+				handleResponse(client, request);
+				return;
+			}
+		}
+
+		ssize_t status = receiveResponse(request, want);
+
+		if (status > 0)
+		{
+			request->responseSize += status;
+			progress(request);
+		}
+		else if (status == 0)
+		{
+			finish(client, request, FT_ERROR, "Server closed the control connection.");
+			return;
+		}
+		else
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				fail(client, request, "Error receiving response");
+			}
+			return;
+		}
+	}
+}
+
+/* Store payload bytes: straight to disk for files, into the growing listing for -l. */
+
+static int storePayload(struct ftRequest *request, const char *data, size_t size)
+{
+	if (request->command == FT_GET)
+	{
+		return sendAll(request->fileDescriptor, data, size);
+	}
+
+	char *grown = realloc(request->listing, request->payloadReceived + size + 1);
+
+	if (grown == NULL)
+	{
+		return -1;
+	}
+
+	request->listing = grown;
+	memcpy(request->listing + request->payloadReceived, data, size);
+	request->listing[request->payloadReceived + size] = '\0';
+	return 0;
+}
+
+/* Read header and payload from the data connection until the socket runs dry. */
+
+static void readPayload(struct ftClient *client, struct ftRequest *request)
+{
+	for (;;)
+	{
+		ssize_t status;
+
+		if (request->headerSize < FRAME_HEADER)
+		{
+			status = recv(payloadSocket(client, request), request->header + request->headerSize, FRAME_HEADER - request->headerSize, 0);
+
+			if (status > 0)
+			{
+				request->headerSize += status;
+				progress(request);
+
+				if (request->headerSize == FRAME_HEADER)
+				{
+					uint32_t length;
+					memcpy(&length, request->header, FRAME_HEADER);
+					request->payloadSize = ntohl(length);
+				}
+				continue;
+			}
+		}
+
+		else if (request->payloadReceived == request->payloadSize)
+		{
+			/* The empty listing still needs a string to hand back. */
+			finish(client, request, FT_OK, (request->command == FT_LIST) ? (request->listing ? request->listing : "") : "File received.");
+			return;
+		}
+
+		else
+		{
+			size_t want = request->payloadSize - request->payloadReceived;
+
+			if (want > FT_SCRATCH)
+			{
+				want = FT_SCRATCH;
+			}
+
+			status = recv(payloadSocket(client, request), client->scratch, want, 0);
+
+			if (status > 0)
+			{
+				if (storePayload(request, client->scratch, status) < 0)
+				{
+					fail(client, request, "Error storing payload");
+					return;
+				}
+
+				request->payloadReceived += status;
+				progress(request);
+				continue;
+			}
+		}
+
+		if (status == 0)
+		{
+			finish(client, request, FT_ERROR, "Server closed the data connection early.");
+		}
+		else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			fail(client, request, "Error receiving payload");
+		}
+		return;
+	}
+}
+
+/* Advance one request after its active socket reported events. */
+
+static void advance(struct ftClient *client, struct ftRequest *request)
+{
+	int error;
+	int finished;
+
+	switch (request->state)
+	{
+		case CONNECT_CONTROL:
+			if ((error = connectResult(request->controlSocket)) != 0)
+			{
+				errno = error;
+				fail(client, request, "Error connecting to server");
+				return;
+			}
+
+			progress(request);
+			request->state = SEND_REQUEST;
+			/* The socket is writable, so send right away. */
+			/* fall through */
+
+		case SEND_REQUEST:
+		{
+			ssize_t status = send(request->controlSocket, request->request + request->requestSent, request->requestSize - request->requestSent, MSG_NOSIGNAL);
+
+			if (status < 0)
+			{
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				{
+					fail(client, request, "Error sending request");
+				}
+				return;
+			}
+
+			request->requestSent += status;
+			progress(request);
+
+			if (request->requestSent == request->requestSize)
+			{
+				/* Local requests get their answer on the same socket. */
+
+				if (client->local)
+				{
+					request->state = READ_RESPONSE;
+
+					if (watch(client, request, request->controlSocket, EPOLLIN) < 0)
+					{
+						fail(client, request, "Error waiting for response");
+					}
+					return;
+				}
+
+				/* Listen for the server giving up while the data connection is tried. */
+
+				request->state = CONNECT_DATA;
+
+				if (watch(client, request, request->controlSocket, EPOLLIN | EPOLLRDHUP) < 0)
+				{
+					fail(client, request, "Error waiting for response");
+					return;
+				}
+
+				connectData(client, request);
+			}
+			return;
+		}
+
+		case CONNECT_DATA:
+			/* Look at the data connect first: the server may have accepted it and said DATA in one go. */
+
+			error = 0;
+			finished = request->dataSocket >= 0 && connectFinished(request->dataSocket);
+
+			if (finished)
+			{
+				error = connectResult(request->dataSocket);
+
+				if (error == 0 && selfConnected(request->dataSocket))
+				{
+					error = ECONNREFUSED;
+				}
+
+				if (error != 0)
+				{
+					dropDataSocket(client, request);
+				}
+			}
+
+			/* An answer before the data connection is up is the server giving up on it. Read it as the response. */
+
+			if ((!finished || error != 0) && controlReadable(request))
+			{
+				if (request->dataSocket >= 0)
+				{
+					dropDataSocket(client, request);
+				}
+
+				request->retryAt = 0;
+				request->state = READ_RESPONSE;
+				readResponse(client, request);
+				return;
+			}
+
+			/* Still connecting, or waiting for the retry timer. */
+
+			if (!finished)
+			{
+				return;
+			}
+
+			/* A refused connect is retried without refreshing the deadline, so a server that never
+			opens the port still times the request out. */
+
+			if (error != 0)
+			{
+				if (scheduleRetry(request, error))
+				{
+					return;
+				}
+
+				errno = error;
+				fail(client, request, "Error connecting data socket");
+				return;
+			}
+
+			/* Connected. From here only the control socket is watched until the response says DATA. */
+
+			epoll_ctl(client->epoll, EPOLL_CTL_DEL, request->dataSocket, NULL);
+			progress(request);
+			request->state = READ_RESPONSE;
+
+			if (watch(client, request, request->controlSocket, EPOLLIN) < 0)
+			{
+				fail(client, request, "Error waiting for response");
+			}
+			return;
+
+		case READ_RESPONSE:
+			readResponse(client, request);
+			return;
+
+		case READ_PAYLOAD:
+			readPayload(client, request);
+			return;
+	}
+}
+
+/* The parts of a client that TCP and local clients share. slots is the concurrency limit. */
+
+static struct ftClient *allocateClient(int slots)
+{
+	struct ftClient *client = calloc(1, sizeof(*client));
+
+	if (client == NULL)
+	{
+		return NULL;
+	}
+
+	client->dataPortCount = slots;
+	client->portInUse = calloc(slots, 1);
+	client->epoll = epoll_create1(EPOLL_CLOEXEC);
+	client->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (client->portInUse == NULL || client->epoll < 0 || client->timer < 0)
+	{
+		ftDestroyClient(client);
+		return NULL;
+	}
+
+	/* The timer is registered with a NULL pointer so the loop can tell it apart from requests. */
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(client->epoll, EPOLL_CTL_ADD, client->timer, &event);
+
+	return client;
+}
+
+struct ftClient *ftCreateClient(const char *hostname, int serverPort, int firstDataPort, int dataPortCount)
+{
+	struct addrinfo hints, *res;
+	struct ftClient *client;
+
+	if (dataPortCount < 1 || firstDataPort < 1024 || firstDataPort + dataPortCount - 1 > 65535)
+	{
+		return NULL;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(hostname, NULL, &hints, &res) != 0)
+	{
+		return NULL;
+	}
+
+	client = allocateClient(dataPortCount);
+
+	if (client == NULL)
+	{
+		freeaddrinfo(res);
+		return NULL;
+	}
+
+	memcpy(&client->server, res->ai_addr, sizeof(client->server));
+	client->server.sin_port = htons(serverPort);
+	client->firstDataPort = firstDataPort;
+	freeaddrinfo(res);
+	return client;
+}
+
+struct ftClient *ftCreateLocalClient(const char *socketPath, int concurrency)
+{
+	struct ftClient *client;
+
+	if (concurrency < 1 || strlen(socketPath) >= sizeof(client->localServer.sun_path))
+	{
+		return NULL;
+	}
+
+	client = allocateClient(concurrency);
+
+	if (client == NULL)
+	{
+		return NULL;
+	}
+
+	client->local = 1;
+	client->localServer.sun_family = AF_UNIX;
+	strcpy(client->localServer.sun_path, socketPath);
+	return client;
+}
+
+void ftDestroyClient(struct ftClient *client)
+{
+	struct ftRequest *request;
+
+	if (client == NULL)
+	{
+		return;
+	}
+
+	while ((request = client->active) != NULL)
+	{
+		removeRequest(&client->active, request);
+		freeRequest(client, request);
+	}
+
+	while ((request = client->pendingHead) != NULL)
+	{
+		client->pendingHead = request->next;
+		freeRequest(client, request);
+	}
+
+	if (client->epoll >= 0)
+	{
+		close(client->epoll);
+	}
+
+	if (client->timer >= 0)
+	{
+		close(client->timer);
+	}
+
+	free(client->portInUse);
+	free(client);
+}
+
+/* Create a request and append it to the pending list. */
+
+static int submit(struct ftClient *client, int command, const char *filename, const char *destination, ftCallback callback, void *context)
+{
+	struct ftRequest *request = calloc(1, sizeof(*request));
+
+	if (request == NULL)
+	{
+		return -1;
+	}
+
+	request->command = command;
+	request->callback = callback;
+	request->context = context;
+	request->controlSocket = -1;
+	request->dataSocket = -1;
+	request->activeSocket = -1;
+	request->fileDescriptor = -1;
+	request->passedDescriptor = -1;
+	request->slot = -1;
+	request->started = now();
+
+	if (filename != NULL)
+	{
+		request->filename = strdup(filename);
+		request->destination = (destination != NULL) ? strdup(destination) : NULL;
+
+		if (request->filename == NULL || (destination != NULL && request->destination == NULL))
+		{
+			freeRequest(client, request);
+			return -1;
+		}
+	}
+
+	if (client->pendingTail != NULL)
+	{
+		client->pendingTail->next = request;
+		request->prev = client->pendingTail;
+	}
+	else
+	{
+		client->pendingHead = request;
+	}
+
+	client->pendingTail = request;
+	client->outstanding++;
+	startPending(client);
+	armTimer(client);
+	return 0;
+}
+
+int ftList(struct ftClient *client, ftCallback callback, void *context)
+{
+	return submit(client, FT_LIST, NULL, NULL, callback, context);
+}
+
+int ftGet(struct ftClient *client, const char *filename, const char *destination, ftCallback callback, void *context)
+{
+	/* Only a local client can hand back a descriptor instead of writing a destination file. */
+
+	if (filename == NULL || (destination == NULL && !client->local) || strlen(filename) == 0 || strlen(filename) > FT_NAMEMAX)
+	{
+		return -1;
+	}
+
+	return submit(client, FT_GET, filename, destination, callback, context);
+}
+
+int ftPoll(struct ftClient *client, int timeoutMs)
+{
+	struct epoll_event events[FT_EVENTS];
+	int count = epoll_wait(client->epoll, events, FT_EVENTS, timeoutMs);
+	int i;
+
+	if (count < 0)
+	{
+		return (errno == EINTR) ? client->outstanding : -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		int j;
+
+		if (events[i].data.ptr == NULL)
+		{
+			uint64_t expirations;
+			read(client->timer, &expirations, sizeof(expirations));
+			continue;
+		}
+
+		/* A request waiting on its data connection has two sockets registered and can show up twice.
+		Advance it once: advance() looks at both sockets, a finished request may already be freed,
+		and epoll is level triggered, so anything still pending is reported again next time. */
+
+		for (j = 0; j < i && events[j].data.ptr != events[i].data.ptr; j++)
+		{
+		}
+
+		if (j == i)
+		{
+			advance(client, events[i].data.ptr);
+		}
+	}
+
+	/* Retry connects whose time has come, and give up on requests that have stopped making progress. */
+
+	double current = now();
+	struct ftRequest *request = client->active;
+
+	while (request != NULL)
+	{
+		struct ftRequest *next = request->next;
+
+		if (request->deadline <= current)
+		{
+			finish(client, request, FT_ERROR, "Timed out waiting for the server.");
+		}
+
+		else if (request->retryAt > 0 && request->retryAt <= current)
+		{
+			if (request->state == CONNECT_CONTROL)
+			{
+				connectControl(client, request);
+			}
+
+			else
+			{
+				connectData(client, request);
+			}
+		}
+
+		request = next;
+	}
+
+	startPending(client);
+	armTimer(client);
+	return client->outstanding;
+}
+
+int ftRun(struct ftClient *client)
+{
+	/* Check before waiting. Requests that failed inside ftGet() or ftList() leave nothing to wait for,
+	and the timer is disarmed, so epoll_wait() would never return. */
+
+	while (client->outstanding > 0)
+	{
+		if (ftPoll(client, -1) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int ftDescriptor(struct ftClient *client)
+{
+	return client->epoll;
+}
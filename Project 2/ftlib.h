@@ -0,0 +1,85 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: ftlib, a native asynchronous client library for ftserver. It speaks the same
+** request layout as sendRequest() in ftclient.py (command frame, data port, and for -g the
+** filename frame and data port again), but runs every request as a small state machine on one
+** epoll event loop, so a single thread can keep hundreds of -l and -g requests in flight.
+** File payloads are written to disk as they arrive instead of being held in memory.
+**
+** A client made with ftCreateLocalClient() talks to ftserver's Unix domain socket (ftserver -u)
+** instead. No data port is used, and a file comes back as a read-only descriptor, so none of its
+** bytes pass through a socket.
+**
+** Typical use:
+**     struct ftClient *client = ftCreateClient("flip1", 30020, 31000, 200);
+**     ftGet(client, "notes.txt", "notes.txt", onDone, NULL);
+**     ftList(client, onDone, NULL);
+**     ftRun(client);
+**     ftDestroyClient(client);
+***********************/
+
+#ifndef FTLIB_H
+#define FTLIB_H
+
+#include <stdint.h>
+
+/* Request types. Same numbers handleRequest() in ftserver.c uses. */
+#define FT_LIST 1
+#define FT_GET 2
+
+/* Completion status handed to callbacks. */
+#define FT_OK 0         /* Listing or file received in full. */
+#define FT_ERROR -1     /* Connection, protocol or disk error. See message. */
+#define FT_REFUSED -2   /* Server answered with an error message instead of DATA. See message. */
+
+/* Passed to the completion callback. Pointers are only valid during the callback. */
+
+struct ftResult
+{
+	int command;           /* FT_LIST or FT_GET. */
+	int status;            /* FT_OK, FT_ERROR or FT_REFUSED. */
+	const char *filename;  /* Requested file, NULL for listings. */
+	const char *message;   /* Listing text on success, otherwise a description of the failure. */
+	uint64_t bytes;        /* Payload bytes received. */
+	double seconds;        /* Time from submission to completion. */
+	int fileDescriptor;    /* Local -g only: read-only descriptor for the served file, else -1.
+	                          Closed after the callback returns, so dup() it to keep it. Read it
+	                          with pread(), as its file position is shared with the server. */
+};
+
+typedef void (*ftCallback)(const struct ftResult *result, void *context);
+
+struct ftClient;
+
+/* Resolve hostname and create an event loop. Data connections use ports firstDataPort
+through firstDataPort + dataPortCount - 1, one per request in flight, so dataPortCount is
+also the concurrency limit. Further requests queue until a port frees up. Returns NULL on failure. */
+struct ftClient *ftCreateClient(const char *hostname, int serverPort, int firstDataPort, int dataPortCount);
+
+/* Create an event loop for a server on this machine listening on the Unix domain socket at
+socketPath. At most concurrency requests are in flight at once. Returns NULL on failure. */
+struct ftClient *ftCreateLocalClient(const char *socketPath, int concurrency);
+
+/* Close every open connection without running callbacks and free the client. */
+void ftDestroyClient(struct ftClient *client);
+
+/* Queue a directory listing. Returns 0 if queued, -1 otherwise. */
+int ftList(struct ftClient *client, ftCallback callback, void *context);
+
+/* Queue a file fetch written to destination. A local client may pass a NULL destination, in which
+case nothing is written and the callback reads result->fileDescriptor instead. Returns 0 if queued,
+-1 otherwise. */
+int ftGet(struct ftClient *client, const char *filename, const char *destination, ftCallback callback, void *context);
+
+/* Run one pass of the event loop, waiting at most timeoutMs (-1 waits indefinitely).
+Returns the number of requests still queued or in flight, or -1 on error. Callbacks run from here. */
+int ftPoll(struct ftClient *client, int timeoutMs);
+
+/* Run the event loop until every request has completed. Returns 0, or -1 on error. */
+int ftRun(struct ftClient *client);
+
+/* The epoll descriptor, for embedding in another event loop. It becomes readable when
+ftPoll(client, 0) has work to do. */
+int ftDescriptor(struct ftClient *client);
+
+#endif
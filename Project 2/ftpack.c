@@ -0,0 +1,416 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: ftpack, the build step for ftserver -a. Packs every regular file in a directory
+** into one archive with a minimal perfect hash index over the names. See archive.h for the layout.
+** The archive is written to a temporary file and renamed into place, so a server that already
+** has the old archive mapped keeps serving it unharmed.
+**
+** Proper syntax: ftpack [DIRECTORY] [ARCHIVE]
+***********************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "../common/framing.h"
+
+/* Longest filename packed, including the null terminator. Same as ftserver's NAMELENGTH. */
+#define NAMELENGTH 256
+
+/* Displacements tried for one bucket before giving up. */
+#define MAXDISPLACEMENT (1u << 24)
+
+/* Buffer for copying file contents. */
+#define COPYBUFFER 65536
+
+/* A file found in the directory. */
+
+struct packedFile
+{
+	char *name;
+	uint64_t size;
+	uint32_t bucket;
+	uint32_t nameOffset;
+};
+
+/* A bucket of the hash, for sorting biggest first. */
+
+struct bucket
+{
+	uint32_t number;
+	uint32_t count;
+	uint32_t first; /* Index of its first file in the byBucket order. */
+};
+
+static struct packedFile *files = NULL;
+
+/* Round size up to a multiple of ARCHIVE_ALIGN. */
+
+uint64_t align(uint64_t size)
+{
+	return (size + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * ARCHIVE_ALIGN;
+}
+
+/* Write length zero bytes, to pad up to an alignment boundary. */
+
+int pad(int fileDescriptor, uint64_t length)
+{
+	static const char zeros[ARCHIVE_ALIGN];
+	return sendAll(fileDescriptor, zeros, length);
+}
+
+int compareBucketOfFile(const void *a, const void *b)
+{
+	uint32_t x = files[*(const uint32_t *) a].bucket;
+	uint32_t y = files[*(const uint32_t *) b].bucket;
+	return (x > y) - (x < y);
+}
+
+int compareBucketSize(const void *a, const void *b)
+{
+	uint32_t x = ((const struct bucket *) a)->count;
+	uint32_t y = ((const struct bucket *) b)->count;
+	return (x < y) - (x > y);
+}
+
+/* Read the regular files in directory, in directory order, into files, and set count. Returns 0, or -1. */
+
+int readDirectory(const char *directory, uint32_t *count)
+{
+	char path[4096];
+	struct dirent *dirstruct;
+	struct stat info;
+	uint32_t capacity = 0;
+	DIR *dirpointer = opendir(directory);
+
+	*count = 0;
+
+	if (dirpointer == NULL)
+	{
+		return -1;
+	}
+
+	while ((dirstruct = readdir(dirpointer)) != NULL)
+	{
+		snprintf(path, sizeof(path), "%s/%s", directory, dirstruct->d_name);
+
+		/* Only regular files are packed, and only those a frame can carry. */
+
+		if (stat(path, &info) < 0 || !S_ISREG(info.st_mode))
+		{
+			continue;
+		}
+
+		if (strlen(dirstruct->d_name) >= NAMELENGTH || (uint64_t) info.st_size > UINT32_MAX)
+		{
+			fprintf(stderr, "Skipping [%s]: name or file too large.\n", dirstruct->d_name);
+			continue;
+		}
+
+		if (*count == capacity)
+		{
+			capacity = (capacity == 0) ? 1024 : capacity * 2;
+			files = realloc(files, capacity * sizeof(*files));
+
+			if (files == NULL)
+			{
+				closedir(dirpointer);
+				return -1;
+			}
+		}
+
+		files[*count].name = strdup(dirstruct->d_name);
+		files[*count].size = info.st_size;
+		(*count)++;
+	}
+
+	closedir(dirpointer);
+	return 0;
+}
+
+/* Build the perfect hash. Buckets are placed biggest first, since they are the hardest to fit,
+and each one takes the first displacement that sends all its files to free slots. Fills in
+displacements (bucketCount of them) and slots (the file in each slot). Returns 0, or -1. */
+
+int buildIndex(uint32_t count, uint32_t bucketCount, uint32_t *displacements, uint32_t *slots)
+{
+	uint32_t *byBucket = malloc((count + 1) * sizeof(uint32_t));
+	struct bucket *buckets = calloc(bucketCount, sizeof(*buckets));
+	char *taken = calloc(count + 1, 1);
+	uint32_t tried[ARCHIVE_BUCKETSIZE * 16];
+	uint32_t i, j;
+	int status = 0;
+
+	if (byBucket == NULL || buckets == NULL || taken == NULL)
+	{
+		status = -1;
+	}
+
+	for (i = 0; status == 0 && i < count; i++)
+	{
+		files[i].bucket = archiveHash(files[i].name, 0) % bucketCount;
+		byBucket[i] = i;
+	}
+
+	if (status == 0)
+	{
+		qsort(byBucket, count, sizeof(uint32_t), compareBucketOfFile);
+
+		for (i = 0; i < bucketCount; i++)
+		{
+			buckets[i].number = i;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			struct bucket *bucket = &buckets[files[byBucket[i]].bucket];
+
+			if (bucket->count == 0)
+			{
+				bucket->first = i;
+			}
+
+			bucket->count++;
+		}
+
+		qsort(buckets, bucketCount, sizeof(*buckets), compareBucketSize);
+	}
+
+	for (i = 0; status == 0 && i < bucketCount && buckets[i].count > 0; i++)
+	{
+		struct bucket *bucket = &buckets[i];
+		uint32_t displacement;
+
+		/* A bucket far bigger than the average means the hash is hopeless for this set. */
+
+		if (bucket->count > sizeof(tried) / sizeof(tried[0]))
+		{
+			status = -1;
+			break;
+		}
+
+		for (displacement = 1; displacement < MAXDISPLACEMENT; displacement++)
+		{
+			for (j = 0; j < bucket->count; j++)
+			{
+				uint32_t slot = archiveHash(files[byBucket[bucket->first + j]].name, displacement) % count;
+				uint32_t k;
+
+				/* The slot must be free and not already claimed by another file in this bucket. */
+
+				for (k = 0; k < j && tried[k] != slot; k++)
+				{
+				}
+
+				if (taken[slot] || k < j)
+				{
+					break;
+				}
+
+				tried[j] = slot;
+			}
+
+			if (j == bucket->count)
+			{
+				break;
+			}
+		}
+
+		if (displacement == MAXDISPLACEMENT)
+		{
+			status = -1;
+			break;
+		}
+
+		displacements[bucket->number] = displacement;
+
+		for (j = 0; j < bucket->count; j++)
+		{
+			taken[tried[j]] = 1;
+			slots[tried[j]] = byBucket[bucket->first + j];
+		}
+	}
+
+	free(byBucket);
+	free(buckets);
+	free(taken);
+	return status;
+}
+
+/* Copy size bytes of the file at path to the archive. */
+
+int copyFile(const char *path, uint64_t size, int archiveDescriptor)
+{
+	static char buffer[COPYBUFFER];
+	uint64_t copied = 0;
+	int fileDescriptor = open(path, O_RDONLY);
+
+	while (fileDescriptor >= 0 && copied < size)
+	{
+		ssize_t count = read(fileDescriptor, buffer, (size - copied < COPYBUFFER) ? size - copied : COPYBUFFER);
+
+		if (count <= 0 || sendAll(archiveDescriptor, buffer, count) < 0)
+		{
+			break;
+		}
+
+		copied += count;
+	}
+
+	if (fileDescriptor >= 0)
+	{
+		close(fileDescriptor);
+	}
+
+	return (copied == size) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct archiveHeader header;
+	uint32_t count;
+	uint32_t i;
+	char path[4096];
+	char temporary[4096];
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "Invalid number of arguments. Usage: [PROGRAM NAME] [DIRECTORY] [ARCHIVE]\n\n");
+		exit(1);
+	}
+
+	if (readDirectory(argv[1], &count) < 0)
+	{
+		fprintf(stderr, "Error. Could not read directory %s.\n", argv[1]);
+		exit(1);
+	}
+
+	uint32_t bucketCount = (count + ARCHIVE_BUCKETSIZE - 1) / ARCHIVE_BUCKETSIZE;
+	bucketCount = (bucketCount == 0) ? 1 : bucketCount;
+
+	uint32_t *displacements = calloc(bucketCount, sizeof(uint32_t));
+	uint32_t *slots = calloc(count + 1, sizeof(uint32_t));
+	struct archiveEntry *entries = calloc(count + 1, sizeof(*entries));
+
+	if (displacements == NULL || slots == NULL || entries == NULL || buildIndex(count, bucketCount, displacements, slots) < 0)
+	{
+		fprintf(stderr, "Error. Could not build the name index.\n");
+		exit(1);
+	}
+
+	/* Lay out the archive. Names and the listing both keep directory order. */
+
+	uint64_t namesSize = 0, listingLength = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		files[i].nameOffset = (uint32_t) namesSize;
+		namesSize += strlen(files[i].name) + 1;
+		listingLength += strlen(files[i].name) + 3; /* name plus "[", "] ". */
+	}
+
+	if (namesSize > UINT32_MAX || listingLength >= UINT32_MAX)
+	{
+		fprintf(stderr, "Error. Too many names for one archive.\n");
+		exit(1);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ARCHIVE_MAGIC, ARCHIVE_MAGICLENGTH);
+	header.byteOrder = ARCHIVE_BYTEORDER;
+	header.fileCount = count;
+	header.bucketCount = bucketCount;
+	header.listingLength = (uint32_t) listingLength;
+	header.bucketsOffset = align(sizeof(header));
+	header.entriesOffset = align(header.bucketsOffset + (uint64_t) bucketCount * sizeof(uint32_t));
+	header.namesOffset = header.entriesOffset + (uint64_t) count * sizeof(struct archiveEntry);
+	header.listingOffset = header.namesOffset + namesSize;
+	header.dataOffset = align(header.listingOffset + listingLength + 1);
+
+	uint64_t offset = header.dataOffset;
+	uint64_t *fileOffsets = calloc(count + 1, sizeof(uint64_t));
+
+	for (i = 0; i < count; i++)
+	{
+		fileOffsets[i] = offset;
+		offset = align(offset + files[i].size);
+	}
+
+	header.totalSize = offset;
+
+	for (i = 0; i < count; i++)
+	{
+		struct packedFile *file = &files[slots[i]];
+
+		entries[i].offset = fileOffsets[slots[i]];
+		entries[i].size = file->size;
+		entries[i].nameOffset = file->nameOffset;
+		entries[i].nameLength = strlen(file->name);
+	}
+
+	/* Write it all to a temporary file next to the archive. */
+
+	snprintf(temporary, sizeof(temporary), "%s.tmp", argv[2]);
+	int archiveDescriptor = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int status = (archiveDescriptor < 0) ? -1 : 0;
+
+	if (status == 0)
+	{
+		status = sendAll(archiveDescriptor, (char *) &header, sizeof(header));
+		status = status ? status : pad(archiveDescriptor, header.bucketsOffset - sizeof(header));
+		status = status ? status : sendAll(archiveDescriptor, (char *) displacements, (uint64_t) bucketCount * sizeof(uint32_t));
+		status = status ? status : pad(archiveDescriptor, header.entriesOffset - header.bucketsOffset - (uint64_t) bucketCount * sizeof(uint32_t));
+		status = status ? status : sendAll(archiveDescriptor, (char *) entries, (uint64_t) count * sizeof(*entries));
+	}
+
+	for (i = 0; status == 0 && i < count; i++)
+	{
+		status = sendAll(archiveDescriptor, files[i].name, strlen(files[i].name) + 1);
+	}
+
+	for (i = 0; status == 0 && i < count; i++)
+	{
+		snprintf(path, sizeof(path), "[%s] ", files[i].name);
+		status = sendAll(archiveDescriptor, path, strlen(path));
+	}
+
+	status = status ? status : pad(archiveDescriptor, header.dataOffset - header.listingOffset - listingLength);
+
+	/* pad() above wrote the listing's terminator as its first zero byte, then filled out to the data. */
+
+	for (i = 0; status == 0 && i < count; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", argv[1], files[i].name);
+		status = copyFile(path, files[i].size, archiveDescriptor);
+
+		if (status == 0)
+		{
+			status = pad(archiveDescriptor, align(files[i].size) - files[i].size);
+		}
+
+		else
+		{
+			fprintf(stderr, "Error. [%s] could not be read, or changed size while packing.\n", files[i].name);
+		}
+	}
+
+	if (archiveDescriptor >= 0 && (close(archiveDescriptor) < 0 || status < 0))
+	{
+		status = -1;
+	}
+
+	if (status < 0 || rename(temporary, argv[2]) < 0)
+	{
+		fprintf(stderr, "Error. Could not write archive %s.\n", argv[2]);
+		unlink(temporary);
+		exit(1);
+	}
+
+	printf("Packed %u files, %llu bytes, into %s\n", count, (unsigned long long) header.totalSize, argv[2]);
+	return 0;
+}
@@ -0,0 +1,439 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: ftreplay, a replay driver for traces recorded with ftserver -r. It reissues every
+** recorded -l and -g at the same offset from the start of the trace as the original (divided by
+** the speed factor), so requests that overlapped in the original overlap again and the server sees
+** the original concurrency. Given two servers it replays the trace against each in turn and
+** reports how their latency and throughput differ, which is how we compare two server builds.
+**
+** Proper syntax: ftreplay [-s SPEED] [-c DATA PORTS] [TRACE FILE] [SERVER] [SERVER]
+** A SERVER is HOSTNAME:SERVER PORT:FIRST DATA PORT, or unix:SOCKET PATH for ftserver -u.
+** -s 2 replays twice as fast as recorded, -s 0.5 at half speed. The default is 1.
+** -c sets how many data ports (and so requests in flight) each replay may use. The default is 256.
+** Files fetched over TCP are written to /dev/null. A request counts as failed when its outcome
+** differs from the original: a file the server sent then and refuses now, or the other way round.
+***********************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ftlib.h"
+#include "trace.h"
+
+/* Default number of data ports. Needs to be at least the peak concurrency of the trace. */
+#define DATAPORTS 256
+
+/* Longest filename read from a trace, with room for the terminator. Matches what the server accepts. */
+#define NAMELENGTH 1024
+
+/* One request read from the trace. */
+
+struct operation
+{
+	struct traceRecord record;
+	char name[NAMELENGTH];
+};
+
+/* What happened to one request in a replay. Filled in by the completion callback. */
+
+struct sample
+{
+	int done;
+	int status;
+	uint64_t bytes;
+	double seconds;
+};
+
+/* Totals for one replay. */
+
+struct replayReport
+{
+	int requests;
+	int errors;      /* Requests that were served in the original and not now, or the other way round. */
+	int refused;     /* Requests that failed now just as they did in the original. */
+	int mismatches;  /* Requests that succeeded with a different payload size than recorded. */
+	int peak;        /* Most requests in flight at once. */
+	uint64_t bytes;
+	double wall;     /* Seconds from the first request to the last completion. */
+	double mean, p50, p95, p99, max; /* Latency in seconds. */
+};
+
+static int inFlight = 0;
+
+/* Current monotonic time in seconds. */
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Completion callback. Just note the outcome in the request's sample. */
+
+void recordSample(const struct ftResult *result, void *context)
+{
+	struct sample *sample = context;
+
+	sample->done = 1;
+	sample->status = result->status;
+	sample->bytes = result->bytes;
+	sample->seconds = result->seconds;
+	inFlight--;
+}
+
+/* Sort helpers. Operations go in arrival order, latencies smallest first. */
+
+int compareArrival(const void *a, const void *b)
+{
+	uint64_t x = ((const struct operation *) a)->record.arrival;
+	uint64_t y = ((const struct operation *) b)->record.arrival;
+	return (x > y) - (x < y);
+}
+
+int compareSeconds(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* Read every -l and -g in the trace into a newly allocated array, sorted by arrival. Invalid
+commands, and -g records with no filename or one too long to read, are counted in skipped and left
+out. Returns the number read, or -1 on error. */
+
+int loadTrace(const char *path, struct operation **operations, int *skipped)
+{
+	FILE *trace = fopen(path, "rb");
+	struct operation *list = NULL;
+	int count = 0, capacity = 0, status;
+
+	*skipped = 0;
+
+	if (trace == NULL || readTraceHeader(trace) < 0)
+	{
+		fprintf(stderr, "Error. %s is not a trace file.\n", path);
+		if (trace != NULL)
+		{
+			fclose(trace);
+		}
+		return -1;
+	}
+
+	while (1)
+	{
+		if (count == capacity)
+		{
+			capacity = (capacity == 0) ? 1024 : capacity * 2;
+			list = realloc(list, capacity * sizeof(*list));
+
+			if (list == NULL)
+			{
+				fclose(trace);
+				return -1;
+			}
+		}
+
+		status = readTraceRecord(trace, &list[count].record, list[count].name, NAMELENGTH);
+
+		if (status <= 0)
+		{
+			break;
+		}
+
+		if (list[count].record.command == TRACE_LIST || (list[count].record.command == TRACE_GET && list[count].name[0] != '\0'))
+		{
+			count++;
+		}
+
+		else
+		{
+			(*skipped)++;
+		}
+	}
+
+	fclose(trace);
+
+	if (status < 0)
+	{
+		fprintf(stderr, "Warning. %s is damaged after record %d, replaying what was read.\n", path, count + *skipped);
+	}
+
+	qsort(list, count, sizeof(*list), compareArrival);
+	*operations = list;
+	return count;
+}
+
+/* Most sessions that overlapped in the original recording, from their arrival times and durations. */
+
+int tracePeak(struct operation *operations, int count)
+{
+	int peak = 0;
+	int i, j;
+
+	/* The trace is sorted by arrival, so only earlier sessions can still be running at each arrival. */
+
+	for (i = 0; i < count; i++)
+	{
+		int running = 1;
+
+		for (j = i - 1; j >= 0; j--)
+		{
+			if (operations[j].record.arrival + operations[j].record.duration * 1000ull > operations[i].record.arrival)
+			{
+				running++;
+			}
+		}
+
+		peak = (running > peak) ? running : peak;
+	}
+
+	return peak;
+}
+
+/* Make a client for a SERVER argument. */
+
+struct ftClient *connectTarget(char *target, int dataPorts, int *local)
+{
+	char host[256];
+	int serverPort, firstDataPort;
+
+	*local = strncmp(target, "unix:", 5) == 0;
+
+	if (*local)
+	{
+		return ftCreateLocalClient(target + 5, dataPorts);
+	}
+
+	if (sscanf(target, "%255[^:]:%d:%d", host, &serverPort, &firstDataPort) != 3)
+	{
+		return NULL;
+	}
+
+	return ftCreateClient(host, serverPort, firstDataPort, dataPorts);
+}
+
+/* Replay the operations against target, speed times faster than recorded, and fill in report.
+Returns 0, or -1 if the client could not be set up or its event loop failed. */
+
+int replay(struct operation *operations, int count, char *target, double speed, int dataPorts, struct replayReport *report)
+{
+	struct sample *samples = calloc(count, sizeof(*samples));
+	double *latencies = calloc(count, sizeof(*latencies));
+	int local;
+	struct ftClient *client = connectTarget(target, dataPorts, &local);
+	int next = 0;
+	int finished = 0;
+	int i;
+
+	memset(report, 0, sizeof(*report));
+
+	if (client == NULL || samples == NULL || latencies == NULL)
+	{
+		fprintf(stderr, "Error. Could not set up a client for %s.\n", target);
+		free(samples);
+		free(latencies);
+		return -1;
+	}
+
+	inFlight = 0;
+	double start = now();
+
+	/* Submit each request when its time comes and run the event loop in between. */
+
+	while (next < count || inFlight > 0)
+	{
+		if (next < count)
+		{
+			double due = start + (operations[next].record.arrival - operations[0].record.arrival) / 1e9 / speed;
+			double wait = due - now();
+
+			if (wait <= 0)
+			{
+				struct operation *operation = &operations[next];
+				int status = (operation->record.command == TRACE_LIST) ? ftList(client, recordSample, &samples[next])
+					: ftGet(client, operation->name, local ? NULL : "/dev/null", recordSample, &samples[next]);
+
+				if (status < 0)
+				{
+					samples[next].done = 1;
+					samples[next].status = FT_ERROR;
+				}
+
+				else
+				{
+					inFlight++;
+					report->peak = (inFlight > report->peak) ? inFlight : report->peak;
+				}
+
+				next++;
+				continue;
+			}
+
+			/* Round up so we never spin on a wait shorter than a millisecond. */
+
+			if (ftPoll(client, (int) (wait * 1000) + 1) < 0)
+			{
+				break;
+			}
+		}
+
+		else if (ftPoll(client, -1) < 0)
+		{
+			break;
+		}
+	}
+
+	report->wall = now() - start;
+	ftDestroyClient(client);
+
+	/* Total up against what happened in the original. Latency only counts successful requests. */
+
+	for (i = 0; i < count; i++)
+	{
+		int served = samples[i].done && samples[i].status == FT_OK;
+		int wasServed = (operations[i].record.flags & TRACE_SERVED) != 0;
+
+		report->requests++;
+
+		if (served != wasServed)
+		{
+			report->errors++;
+		}
+
+		if (!served)
+		{
+			report->refused += !wasServed;
+			continue;
+		}
+
+		if (wasServed && operations[i].record.bytes != samples[i].bytes)
+		{
+			report->mismatches++;
+		}
+
+		report->bytes += samples[i].bytes;
+		report->mean += samples[i].seconds;
+		latencies[finished++] = samples[i].seconds;
+	}
+
+	if (finished > 0)
+	{
+		qsort(latencies, finished, sizeof(*latencies), compareSeconds);
+		report->mean /= finished;
+		report->p50 = latencies[(finished - 1) * 50 / 100];
+		report->p95 = latencies[(finished - 1) * 95 / 100];
+		report->p99 = latencies[(finished - 1) * 99 / 100];
+		report->max = latencies[finished - 1];
+	}
+
+	free(samples);
+	free(latencies);
+	return (next < count || inFlight > 0) ? -1 : 0;
+}
+
+void printReport(char *target, struct replayReport *report)
+{
+	printf("%s\n", target);
+	printf("  %d requests, %d failed, %d refused as in the original, %d with a different size than recorded, %d in flight at most\n",
+		report->requests, report->errors, report->refused, report->mismatches, report->peak);
+	printf("  latency ms: mean %.2f  p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+		report->mean * 1000, report->p50 * 1000, report->p95 * 1000, report->p99 * 1000, report->max * 1000);
+	printf("  throughput: %.1f requests/s, %.2f MB/s over %.2f seconds\n",
+		report->requests / report->wall, report->bytes / report->wall / (1024 * 1024), report->wall);
+}
+
+/* Percentage change from a to b, for the comparison. */
+
+double change(double a, double b)
+{
+	return (a > 0) ? 100.0 * (b - a) / a : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+	double speed = 1.0;
+	int dataPorts = DATAPORTS;
+	struct operation *operations;
+	struct replayReport reports[2];
+	int skipped;
+	int option;
+	int i;
+
+	while ((option = getopt(argc, argv, "s:c:")) != -1)
+	{
+		if (option == 's' && atof(optarg) > 0)
+		{
+			speed = atof(optarg);
+		}
+
+		else if (option == 'c' && atoi(optarg) > 0)
+		{
+			dataPorts = atoi(optarg);
+		}
+
+		else
+		{
+			fprintf(stderr, "Usage: [PROGRAM NAME] [-s SPEED] [-c DATA PORTS] [TRACE FILE] [SERVER] [SERVER]\n\n");
+			exit(1);
+		}
+	}
+
+	int servers = argc - optind - 1;
+
+	if (servers < 1 || servers > 2)
+	{
+		fprintf(stderr, "Invalid number of arguments. Usage: [PROGRAM NAME] [-s SPEED] [-c DATA PORTS] [TRACE FILE] [SERVER] [SERVER]\n");
+		fprintf(stderr, "A SERVER is HOSTNAME:SERVER PORT:FIRST DATA PORT or unix:SOCKET PATH.\n\n");
+		exit(1);
+	}
+
+	int count = loadTrace(argv[optind], &operations, &skipped);
+
+	if (count <= 0)
+	{
+		fprintf(stderr, "Error. No requests to replay in %s.\n", argv[optind]);
+		exit(1);
+	}
+
+	double span = (operations[count - 1].record.arrival - operations[0].record.arrival) / 1e9;
+
+	printf("Trace %s: %d requests over %.2f seconds, %d in flight at most", argv[optind], count, span, tracePeak(operations, count));
+	printf(skipped > 0 ? ", %d unreplayable records skipped\n" : "\n", skipped);
+	printf("Replaying at %gx speed\n\n", speed);
+
+	/* Servers are replayed one after the other, so neither run competes with the other for the machine. */
+
+	for (i = 0; i < servers; i++)
+	{
+		if (replay(operations, count, argv[optind + 1 + i], speed, dataPorts, &reports[i]) < 0)
+		{
+			fprintf(stderr, "Error. Replay against %s did not finish.\n", argv[optind + 1 + i]);
+			free(operations);
+			exit(1);
+		}
+
+		printReport(argv[optind + 1 + i], &reports[i]);
+	}
+
+	/* Negative latency changes and positive throughput changes mean the second server did better. */
+
+	if (servers == 2)
+	{
+		printf("\nSecond vs first server:\n");
+		printf("  latency: mean %+.1f%%  p50 %+.1f%%  p95 %+.1f%%  p99 %+.1f%%  max %+.1f%%\n",
+			change(reports[0].mean, reports[1].mean), change(reports[0].p50, reports[1].p50),
+			change(reports[0].p95, reports[1].p95), change(reports[0].p99, reports[1].p99),
+			change(reports[0].max, reports[1].max));
+		printf("  throughput: %+.1f%% requests/s, %+.1f%% MB/s\n",
+			change(reports[0].requests / reports[0].wall, reports[1].requests / reports[1].wall),
+			change(reports[0].bytes / reports[0].wall, reports[1].bytes / reports[1].wall));
+		printf("  failures: %d -> %d\n", reports[0].errors, reports[1].errors);
+	}
+
+	free(operations);
+	return (reports[0].errors == 0 && (servers == 1 || reports[1].errors == 0)) ? 0 : 1;
+}
@@ -8,6 +8,8 @@
 ** Proper syntax: ftserver [PORT NUMBER]
 ***********************/
 
+#define _GNU_SOURCE /* ppoll(). */
+
 /* Some standard includes from the beej networking guide. I mostly used the includes I used
 for project 1, but added <dirent.h>, <stdint.h>, and <signal.h> because I needed them. */
 
@@ -17,23 +19,72 @@ for project 1, but added <dirent.h>, <stdint.h>, and <signal.h> because I needed
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdint.h>
 #include <signal.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+
+#include "../common/framing.h" /* Length prefixed framing shared with Project 1. */
+#include "bufferpool.h" /* Shared pool of I/O buffers borrowed by each session. */
+#include "prefetch.h" /* Warms the files clients are likely to ask for next. */
+#include "trace.h" /* Binary record of every session, for replaying traffic later. */
+#include "archive.h" /* Packed, memory mapped archives of small files. */
 
 #define HANDLE "ftserver" /* Define handle for being used by functions below. */
 
 /* Because we frequently create buffers, I have defined BUFFER for the size of messages, 
-and MAXBUFFER for the maximum size for reading from files. Most protocols use 8192 max. */
+and MAXBUFFER for the size of each pooled buffer. Most protocols use 8192 max, but a bigger
+buffer means fewer system calls per file. */
 
 /* Message buffer size.*/
 #define BUFFER 1024
 
-/* File read buffer size. */
-#define MAXBUFFER 8192
+/* Pooled buffer size. The first BUFFER bytes hold the request, the rest is for file data and listings. */
+#define MAXBUFFER 65536
+
+/* Default memory for the buffer pool, in megabytes. Change it with -m. */
+#define POOLMEGABYTES 64
+
+/* Default prefetch budget, in megabytes. Change it with -p, or turn prefetching off with -p 0. */
+#define PREFETCHMEGABYTES 32
+
+/* Longest directory entry name, including the null terminator. */
+#define NAMELENGTH 256
+
+/* Seconds to wait for the client to connect to the data port. A session whose client has given up
+then ends instead of holding its buffer and its port forever. ftlib gives up after as long. */
+#define DATATIMEOUT 30
+
+/* The buffer pool, created once before the first fork, and the buffer this session has borrowed from it. */
+static struct bufferPool *pool = NULL;
+static char *sessionBuffer = NULL;
+
+/* Set by the SIGCHLD handler when it reaps a child, so the main loop knows to reclaim buffers. */
+static volatile sig_atomic_t childExited = 0;
+
+/* The shared prefetcher, or NULL when prefetching is off, and a flag set by SIGUSR1 asking the
+parent to print the prefetch counters. */
+static struct prefetcher *prefetcher = NULL;
+static volatile sig_atomic_t reportRequested = 0;
+
+/* The trace file opened with -r, or -1 when not tracing. Each session fills in its record as it
+goes, points traceName at the requested filename, and writes the record when it ends. */
+static int traceDescriptor = -1;
+static struct traceRecord sessionTrace;
+static char *traceName = NULL;
+static int traceRequested = 0;
+
+/* The archive mapped with -a, or NULL to serve the current working directory. */
+static struct archive *archive = NULL;
 
 /* Some functions are used by others, so first I list prototypes of all functions used by main. Then I define these functions
 and end with the main() function, which will utilize these functions. */
@@ -43,24 +94,32 @@ and end with the main() function, which will utilize these functions. */
 int max(int a, int b);
 
 void sigintHandle(int sigNum);
+void reportHandle(int sigNum);
+void printPrefetchStats(void);
 void removeNewline(char *string);
 int getLine(char *buffer, char *handle);
 
 int portValidation(char *input);
 int startServer(int port);
+int startLocalServer(char *path);
+int acceptData(int dataListener);
+int clientGone(int clientSocket);
 
-int sendMessage(int sockDescriptor, char *message);
-int receiveMessage(int sockDescriptor, char *message, unsigned size);
+int handleRequest(struct frameReader *reader, char *buffer);
 
-unsigned sendNumber(int sockDescriptor, unsigned number);
-unsigned receiveNumber(int sockDescriptor);
+int listDirectory(char *directory, size_t size, char *first);
+int findFile(char *filename, char *following);
+uint32_t clientAddress(int clientSocket);
 
-int handleRequest(int clientSocket, char *buffer);
+int sendFile(char *filename, char *buffer, size_t size, int clientDataSocket);
 
-int readFile(char *filename, char *string);
-int sendFile(char* file, int clientDataSocket, int clientSocket);
+int sendResponse(char *message, int clientSocket);
 
-int sendResponse(char *sentMessage, char *message, int clientSocket);
+void traceRequest(int requestNumber, char *name);
+void traceServed(int status, uint64_t bytes);
+const char *getListing(char *directory, size_t size, char *first, uint32_t *length);
+void endSession(int clientSocket);
+void serveLocal(int clientSocket);
 
 /* -- Function definitions --*/
 
@@ -85,10 +144,46 @@ void sigintHandle(int sigNum)
 {
 	pid_t pid; /* Find process id. */
 	int status;
-	pid = waitpid(-1, &status, WNOHANG); /* Wait for child to exit. */
+	/* Signals arriving together are merged into one, so reap every child that has exited. */
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		childExited = 1;
+	}
 }
 
 
+/* Handler for SIGUSR1. Only sets a flag, since printf() is not safe in a signal handler. The main
+loop sees the flag when the signal interrupts ppoll(). */
+
+void reportHandle(int sigNum)
+{
+	reportRequested = 1;
+}
+
+/* Print the prefetch counters: how many requested files had been warmed, and how much is warm now. */
+
+void printPrefetchStats(void)
+{
+	struct prefetchStats stats;
+
+	if (prefetcher == NULL)
+	{
+		printf("Prefetching is off.\n");
+		return;
+	}
+
+	prefetchStats(prefetcher, &stats);
+
+	uint64_t requests = stats.hits + stats.misses;
+
+	printf("Prefetch: %llu hits, %llu misses (%.1f%% hit rate), %llu files warmed, %llu skipped over budget, %llu dropped, %llu of %llu bytes in use\n",
+		(unsigned long long) stats.hits, (unsigned long long) stats.misses,
+		(requests > 0) ? 100.0 * stats.hits / requests : 0.0,
+		(unsigned long long) stats.warmed, (unsigned long long) stats.overBudget, (unsigned long long) stats.dropped,
+		(unsigned long long) stats.inUse, (unsigned long long) stats.budget);
+	fflush(stdout);
+}
+
 /* Take string and remove trailing newline if it exists, replacing it with a null terminator.*/
 
 void removeNewline(char *string)
@@ -158,9 +253,10 @@ int startServer(int port)
 		return -1;
 	}
 
-	/* If listening on the port fails, return -1. */
+	/* If listening on the port fails, return -1. The backlog is as deep as the system allows, since
+	native clients open many control connections at once and a full backlog drops their SYNs. */
 
-	if (listen(sockDescriptor, 10) < 0)
+	if (listen(sockDescriptor, SOMAXCONN) < 0)
 	{
 		return -1;
 	}
@@ -170,186 +266,464 @@ int startServer(int port)
 	return sockDescriptor;
 }
 
-/* Takes a socket file descriptor and message that will be sent. 
-Sends until full message is delivered. Will return 0 on success, or -1 if unsuccessful. */
+/* Takes a filesystem path and listens on a Unix domain socket there, for clients on the same machine.
+A stale socket file left by an earlier run is removed first, but anything at path that is not a
+socket is left alone and startup fails, so a mistyped -u cannot delete a file. Returns -1 if it
+fails, and the file descriptor of the socket otherwise. */
+
+int startLocalServer(char *path)
+{
+	int sockDescriptor;
+	struct sockaddr_un server;
+	struct stat info;
+
+	if (strlen(path) >= sizeof(server.sun_path))
+	{
+		return -1;
+	}
+
+	if (lstat(path, &info) == 0)
+	{
+		if (!S_ISSOCK(info.st_mode))
+		{
+			fprintf(stderr, "Error. %s exists and is not a socket.\n", path);
+			return -1;
+		}
+
+		unlink(path);
+	}
+
+	if ((sockDescriptor = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		return -1;
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	strcpy(server.sun_path, path);
+
+	if (bind(sockDescriptor, (struct sockaddr *) &server, sizeof(server)) < 0 || listen(sockDescriptor, SOMAXCONN) < 0)
+	{
+		close(sockDescriptor);
+		return -1;
+	}
+
+	return sockDescriptor;
+}
+
+/* Takes the listening data socket. Waits up to DATATIMEOUT seconds for the client to connect and
+returns the connected socket, or -1 if the client never came. */
+
+int acceptData(int dataListener)
+{
+	struct pollfd listener;
+	int status;
+
+	listener.fd = dataListener;
+	listener.events = POLLIN;
+
+	do
+	{
+		status = poll(&listener, 1, DATATIMEOUT * 1000);
+	} while (status < 0 && errno == EINTR);
+
+	return (status > 0) ? accept(dataListener, NULL, NULL) : -1;
+}
+
+/* Takes the client control socket. Returns 1 if the client has already hung up. A session can wait a
+long time for a buffer, and a client that gave up in the meantime may have handed its data port to a
+newer request, which must not end up connected to us. */
+
+int clientGone(int clientSocket)
+{
+	char byte;
+	struct pollfd control;
+
+	control.fd = clientSocket;
+	control.events = POLLIN;
+
+	/* The client sends nothing after its request, so a readable socket with nothing to read is closed. */
+
+	return poll(&control, 1, 0) > 0 && recv(clientSocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/* Takes the frame reader for the control connection and buffer address. Will receive client request,
+and after processing it, return integer code for the request type. Returns 0 if the command
+could not be received at all. */
+
+int handleRequest(struct frameReader *reader, char *buffer) 
+{
+	uint32_t size;
+
+	/* Get command. The framing layer reads the size and adds the null terminator for us. */
+
+	if (receiveFrame(reader, buffer, BUFFER, &size) != 0)
+	{
+		return 0;
+	}
+
+	/* return appropriate code depending on what the command was. -g get command
+	has a return type of 2. -l list command has a return type of 1. Otherwise, return -1. */
+
+
+	if (strncmp("-g", buffer, strlen(buffer)) == 0) 
+	{
+		return 2;
+	}
+
+	else if (strncmp("-l", buffer, strlen(buffer)) == 0) 
+	{
+		return 1;
+	}
+
+	else 
+	{
+		return -1;
+	}
+}
+
+/* Takes a buffer and its size. Writes the names in the current working directory into it as
+"[name] [name] ", leaving out . and .., and stops before the buffer would overflow. If first is
+not NULL, the first name is also copied there (it must hold NAMELENGTH bytes). Returns 0
+if the whole listing fit, and -1 if it was cut short or the directory could not be read. */
 
-int sendMessage(int sockDescriptor, char *message) 
+int listDirectory(char *directory, size_t size, char *first)
 {
-	/* Status variable.*/
-	unsigned status;
+	char path[BUFFER];
+	size_t used = 0;
+	int status = 0;
 
-	/* Variable for size of message. */
-	unsigned size = strlen(message) + 1;
+	directory[0] = '\0';
 
-	/* Variable to hold the total number of bytes sent. */
-	unsigned bytesSent = 0;
+	if (first != NULL)
+	{
+		first[0] = '\0';
+	}
+
+	/* Get full path for current working directory, then get the contents of the directory. */
 
-	/* While sending is not complete, continue the loop. */
+	DIR *dirpointer = (getcwd(path, BUFFER) != NULL) ? opendir(path) : NULL;
+	struct dirent *dirstruct = NULL; /* Create directory structure. */
 
-	while (bytesSent < size)
+	if (dirpointer == NULL)
 	{
-		/* Continue to send message.*/
-		status = write(sockDescriptor, message + bytesSent, size - bytesSent);
+		return -1;
+	}
 
-		/* Add bytes sent to bytes sent. */
-		bytesSent += status;
+	while ((dirstruct = readdir(dirpointer)) != NULL) 
+	{
+		/* Filter out . and .. listings and build the directory list appropriately. */
 
-		if (status < 0) 
+		if ((strcmp(dirstruct->d_name, ".") != 0) && (strcmp(dirstruct->d_name, "..") != 0)) 
 		{
-			return -1;
+			size_t length = strlen(dirstruct->d_name) + 3; /* name plus "[", "] ". */
+
+			if (used + length >= size)
+			{
+				status = -1;
+				break;
+			}
+
+			if (used == 0 && first != NULL)
+			{
+				strcpy(first, dirstruct->d_name);
+			}
+
+			sprintf(directory + used, "[%s] ", dirstruct->d_name);
+			used += length;
 		}
+	}
+
+	closedir(dirpointer);
+	return status;
+}
+
+/* Takes a filename from a client. Returns 1 if it names a regular file in the current working
+directory, and 0 otherwise. Only names found by readdir() are accepted, so a client cannot
+reach outside the directory with a path, and directories and devices are refused. If following is not NULL, the entry listed after the
+file is copied there (it must hold NAMELENGTH bytes), or "" if there is none. */
+
+int findFile(char *filename, char *following)
+{
+	char path[BUFFER];
+	int validFile = 0; /* Initially set validFile to false. */
+
+	if (following != NULL)
+	{
+		following[0] = '\0';
+	}
+
+	DIR *dirpointer = (getcwd(path, BUFFER) != NULL) ? opendir(path) : NULL;
+	struct dirent *dirstruct = NULL;
 
-		/* If complete. */
+	if (dirpointer == NULL)
+	{
+		return 0;
+	}
 
-		else if (status == 0) 
+	while ((dirstruct = readdir(dirpointer)) != NULL) 
+	{
+		/* Compare the file name the client gave us to all file names. If it is found, set validFile to true. */
+
+		if (strncmp(filename, dirstruct->d_name, max(strlen(dirstruct->d_name), strlen(filename))) == 0) 
 		{
-			bytesSent = size - bytesSent;
+			struct stat info;
+			validFile = stat(filename, &info) == 0 && S_ISREG(info.st_mode);	/* Set valid file to true if it is a regular file. */
+			break;
 		}
 	}
-	return 0;
+
+	/* Keep reading one more entry for the prefetcher, skipping . and .. as the listing does. */
+
+	while (validFile && following != NULL && (dirstruct = readdir(dirpointer)) != NULL)
+	{
+		if ((strcmp(dirstruct->d_name, ".") != 0) && (strcmp(dirstruct->d_name, "..") != 0))
+		{
+			strcpy(following, dirstruct->d_name);
+			break;
+		}
+	}
+
+	closedir(dirpointer);
+	return validFile;
+}
+
+/* Takes a client socket. Returns the client's IPv4 address in host byte order, or 0 for clients on
+the Unix domain socket. The prefetcher uses it to tell clients apart. */
+
+uint32_t clientAddress(int clientSocket)
+{
+	struct sockaddr_in address;
+	socklen_t length = sizeof(address);
+
+	if (getpeername(clientSocket, (struct sockaddr *) &address, &length) < 0 || address.sin_family != AF_INET)
+	{
+		return 0;
+	}
+
+	return ntohl(address.sin_addr.s_addr);
 }
 
-/* Takes socket file descriptor, an output string to receive a messaage in, and the size of the message.
-Will read until the entire message has been received, then copy it to the string. Will return 0 if successful 
-and -1 if not. */
+/* Takes filename, a buffer and its size, and the client data socket file descriptor. Streams the file
+to the client as one frame, a buffer at a time, so files of any size go through the same pooled buffer.
+The size goes out with the first piece, then the data socket is closed. Returns 0 if successful. */
 
-int receiveMessage(int sockDescriptor, char *message, unsigned size) 
+int sendFile(char *filename, char *buffer, size_t size, int clientDataSocket) 
 {
-	char buffer[BUFFER];
-	unsigned status;
-	unsigned bytesReceived = 0;
+	struct stat info;
+	int status = -1;
+	int fileDescriptor = open(filename, O_RDONLY); /* Open file. */
+
+	/* Frames carry a 32 bit size, so larger files cannot be sent. Only regular files have a size to promise. */
 
-	while (bytesReceived < size) 
+	if (fileDescriptor >= 0 && fstat(fileDescriptor, &info) == 0 && S_ISREG(info.st_mode) && (uint64_t) info.st_size <= UINT32_MAX)
 	{
-		status = read(sockDescriptor, buffer + bytesReceived, size - bytesReceived);
-		bytesReceived += status;
+		off_t sent = 0;
+		ssize_t count = read(fileDescriptor, buffer, (size_t) info.st_size < size ? (size_t) info.st_size : size);
 
-		if (bytesReceived < 0) 
+		status = (count < 0) ? -1 : sendFrameStart(clientDataSocket, info.st_size, buffer, count);
+
+		/* Send the rest as it is read. The header promised exactly st_size bytes, so never read past
+		that if the file grows, and fail if it shrinks. */
+
+		for (sent = (count > 0) ? count : 0; status == 0 && count > 0 && sent < info.st_size; sent += count)
 		{
-			return -1;
+			size_t remaining = info.st_size - sent;
+			count = read(fileDescriptor, buffer, remaining < size ? remaining : size);
+			status = (count <= 0) ? -1 : sendAll(clientDataSocket, buffer, count);
 		}
 
-		else if (status == 0) 
+		if (sent != info.st_size)
 		{
-			bytesReceived = size - bytesReceived;
+			status = -1;
 		}
+
+		traceServed(status, sent); /* For the trace, if there is one. */
 	}
 
-	strncpy(message, buffer, size); /* Copy buffer into message variable. */
+	if (fileDescriptor >= 0)
+	{
+		close(fileDescriptor); /* Close file. */
+	}
 
-	return 0;
+	if (status == 0)
+	{
+		printf("File sent successfully. Closing client data socket.\n");
+	}
+
+	close(clientDataSocket);            // close the data line
+	return status;
 }
 
-/* Takes socket descriptor and sends integer parameter over the socket. 
-Returns -1 if unsuccessful and 0 if successful. */
+/* Takes a message and the socket file descriptor, and sends the message to the client as one frame. */
 
-unsigned sendNumber(int sockDescriptor, unsigned number) 
+int sendResponse(char* message, int clientSocket) 
 {
-	unsigned realNumber = number;
-	int status = write(sockDescriptor, &realNumber, sizeof(unsigned));
+	return sendFrame(clientSocket, message, strlen(message));	// send size and response together.
+}
+
+/* Takes a buffer of size bytes. Returns the -l listing and sets length. With an archive the
+listing comes prebuilt from its index and nothing is read from disk. Otherwise the current working
+directory is listed into directory, and its first entry copied to first for the prefetcher. */
 
-	if (status < 0) 
+const char *getListing(char *directory, size_t size, char *first, uint32_t *length)
+{
+	if (archive != NULL)
 	{
-		return -1;
+		first[0] = '\0';
+		return archiveListing(archive, length);
 	}
 
-	else
+	listDirectory(directory, size, first);
+	*length = strlen(directory);
+	return directory;
+}
+
+/* Takes the request number from handleRequest() and the requested filename, or NULL for -l and
+invalid commands. Marks the session as one to record in the trace. */
+
+void traceRequest(int requestNumber, char *name)
+{
+	sessionTrace.command = (requestNumber == 1) ? TRACE_LIST : (requestNumber == 2) ? TRACE_GET : TRACE_INVALID;
+	traceName = name;
+	traceRequested = 1;
+}
+
+/* Takes the status of sending the payload (0 if it all went out) and its size. Marks the session as
+served in the trace, so a replay can tell requests that worked from ones that failed. */
+
+void traceServed(int status, uint64_t bytes)
+{
+	if (status == 0)
 	{
-		return 0;
+		sessionTrace.bytes = bytes;
+		sessionTrace.flags |= TRACE_SERVED;
 	}
 }
 
-/* Takes socket descriptor and receives integer over the socket. Returns -1 if unsuccessful and 
-0 if successful. */
+/* Takes the client socket. Ends the session in the child process: closes the connection, writes the
+trace record if tracing, gives the session's buffer back to the pool, and exits. */
 
-unsigned receiveNumber(int sockDescriptor)
+void endSession(int clientSocket)
 {
-	unsigned number;
-	int status = read(sockDescriptor, &number, sizeof(unsigned));
+	close(clientSocket);
 
-	if (status < 0) 
+	/* Sessions that never got as far as a command are not recorded, since there is nothing to replay. */
+
+	if (traceDescriptor >= 0 && traceRequested)
 	{
-		return -1;
+		sessionTrace.duration = (uint32_t) ((traceClock() - sessionTrace.arrival) / 1000);
+		writeTraceRecord(traceDescriptor, &sessionTrace, traceName);
 	}
 
-	else
+	if (sessionBuffer != NULL)
 	{
-		return number;
+		returnBuffer(pool, sessionBuffer);
 	}
-		
+
+	_exit(0); /* _exit(0) used because exiting child process. */
 }
 
-/* Takes socket file descriptor and buffer address. Will receive client request,
-and after processing it, return integer code for the request type. */
+/* Takes a client socket accepted on the Unix domain socket and serves one request on it. The request
+is the command frame, followed by the filename frame for -g. No data port is involved:
+-l answers "DATA" and then the listing on the same socket, and -g answers "FILE" with a read-only
+descriptor for the file attached through SCM_RIGHTS, so the client reads the file itself and
+none of its bytes pass through the socket. Runs in the child process and exits it. */
 
-int handleRequest(int clientSocket, char *buffer) 
+void serveLocal(int clientSocket)
 {
-	int size = receiveNumber(clientSocket); /* Get size of incoming command message from client. */
-	int receivedMessage = receiveMessage(clientSocket, buffer, size); /* Get command.*/
-	buffer[size] = '\0'; /* Add null terminator.*/
+	char *receivedMessage = sessionBuffer;        /* The request goes at the start of the session buffer, */
+	char *directory = sessionBuffer + BUFFER;     /* and the listing after it. */
+	char nextName[NAMELENGTH];                    /* Entry after the requested one, for the prefetcher. */
+	struct frameReader reader;
+	uint32_t size;
 
-	/* return appropriate code depending on what the command was. -g get command
-	has a return type of 2. -l list command has a return type of 1. Otherwise, return -1. */
+	initReader(&reader, clientSocket);
 
+	int requestNumber = handleRequest(&reader, receivedMessage);
+	printf("Local request # is: %d\n", requestNumber);
 
-	if (strncmp("-g", buffer, strlen(buffer)) == 0) 
+	if (requestNumber != 0)
 	{
-		return 2;
+		traceRequest(requestNumber, NULL);
 	}
 
-	else if (strncmp("-l", buffer, strlen(buffer)) == 0) 
+	if (requestNumber == 1)
 	{
-		return 1;
+		uint32_t length;
+		const char *listing = getListing(directory, poolBufferSize(pool) - BUFFER, nextName, &length);
+
+		sendResponse("DATA", clientSocket);
+		traceServed(sendFrame(clientSocket, listing, length), length);
+		prefetchRequest(prefetcher, 0, PREFETCH_LISTING, nextName);
 	}
 
-	else 
+	else if (requestNumber == 2)
 	{
-		return -1;
-	}
-}
+		if (receiveFrame(&reader, receivedMessage, BUFFER, &size) != 0)
+		{
+			fprintf(stderr, "Error in receiving the filename from the client.\n");
+		}
 
-/* Takes filename and string pointer. Opens the file, reads the contents, and writes
-the contents to the string. Will return 0 if successful. Used stack overflow to figure out how. */
+		else
+		{
+			traceName = receivedMessage;
 
-int readFile(char *filename, char *string) 
-{
-	
-	FILE *filePointer; /* Create file pointer. */
-	filePointer = fopen(filename, "rb"); /* Open file. */
-	fseek(filePointer, 0, SEEK_END); /* Find end of file. */
-	long fsize = ftell(filePointer); /* Determine size of file. */
-	fseek(filePointer, 0, SEEK_SET); /* Position at beginning of file. */
-
-	char *buffer = malloc(fsize + 1); /* Create buffer large enough to read entire file.*/
-	fread(buffer, fsize, 1, filePointer); /* Read file into buffer. */
-	buffer[fsize] = '\0'; /* Add null terminator. */
-
-	fclose(filePointer); /* Close file. */
-	strncpy(string, buffer, MAXBUFFER); /* Copy buffer into the string. */
-	return 0;
-}
+			/* A file in the archive has no descriptor of its own, so the client gets a sealed copy in memory. */
 
-/* Takes file buffer, client data socket file descriptor, and client 
-control socket descriptor. Sends file to client using data socket, then close connection. */
+			const char *contents;
+			uint64_t length;
+			int fileDescriptor;
 
+			if (archive != NULL)
+			{
+				fileDescriptor = findArchiveFile(archive, receivedMessage, &contents, &length) ? archiveDescriptor(contents, length) : -1;
+			}
 
-int sendFile(char* file, int clientDataSocket, int clientSocket) 
-{
-	int r = sendNumber(clientDataSocket, (strlen(file))); /* Send size. */
-	r = sendMessage(clientDataSocket, file);            // send the reponse
-	printf("File sent successfully. Closing client data socket.\n");
-	close(clientDataSocket);            // close the data line
-}
+			else
+			{
+				struct stat info;
+				fileDescriptor = findFile(receivedMessage, nextName) ? open(receivedMessage, O_RDONLY) : -1;
 
-/* Takes message buffer to be sent to client, a message, and the socket file descriptor. Copies
-message into buffer and send to client. */
+				/* The name could have been replaced by a directory since findFile() looked, so check what was opened. */
 
+				if (fileDescriptor >= 0 && (fstat(fileDescriptor, &info) < 0 || !S_ISREG(info.st_mode)))
+				{
+					close(fileDescriptor);
+					fileDescriptor = -1;
+				}
+			}
 
-int sendResponse(char *sentMessage, char* message, int clientSocket) 
-{
-	strncpy(sentMessage, message, BUFFER);			// copy message into sentMessage buffer. 
-	int r = sendNumber(clientSocket, (strlen(sentMessage)));	// Send size.
-	r = sendMessage(clientSocket, sentMessage);		// send the reponse
+			if (fileDescriptor < 0)
+			{
+				printf("[%s] is an invalid filename\n", receivedMessage);
+				sendResponse("Requested file does not exist.", clientSocket);
+			}
+
+			else
+			{
+				struct stat info;
+
+				printf("Passing descriptor for [%s] to local client\n", receivedMessage);
+
+				/* The bytes never cross the socket, but the trace records the size of the file the client was handed. */
+
+				if (sendFrameDescriptor(clientSocket, "FILE", 4, fileDescriptor) == 0 && fstat(fileDescriptor, &info) == 0)
+				{
+					traceServed(0, info.st_size);
+				}
+				close(fileDescriptor);
+				prefetchRequest(prefetcher, 0, receivedMessage, nextName);
+			}
+		}
+	}
+
+	else if (requestNumber == -1)
+	{
+		sendResponse("Invalid command. Only -g and -l are valid commands.\n", clientSocket);
+	}
+
+	endSession(clientSocket);
 }
 
 /* -- BEGINNING MAIN PROGRAM -- */
@@ -357,26 +731,80 @@ int sendResponse(char *sentMessage, char* message, int clientSocket)
 int main(int argc, char *argv[])
 {
 	signal(SIGCHLD, sigintHandle); // start the signal handler
+	signal(SIGUSR1, reportHandle); // kill -USR1 prints the prefetch counters
 
-	char buffer[BUFFER];        /* buffer for messages in general. */
-	char receivedMessage[BUFFER];  /* string to hold received Messages. */
-	char sentMessage[BUFFER];	/* string to hold messages that will be sent. */
-	int size;                   /* Variable to hold size of messages that are sent or received. */
+	char *receivedMessage;      /* string to hold received Messages. Points into the session buffer. */
+	uint32_t size;              /* Variable to hold size of messages that are sent or received. */
 	int status;                 /* Variable to hold status of messages that are sent or received. */
-	int dataPortNumber; /* Variable to hold number of data port. */
+	uint32_t dataPortNumber; /* Variable to hold number of data port. */
+	struct frameReader reader;  /* Buffered reader for the client control connection. */
+
+	char *localPath = NULL;     /* Path of the Unix domain socket, if -u was given. */
+	int localDescriptor = -1;   /* Listening Unix domain socket, or -1. */
+	int poolMegabytes = POOLMEGABYTES; /* Memory for the buffer pool. */
+	int hugePages = 0;          /* Back the buffer pool with huge pages if set. */
+	int prefetchMegabytes = PREFETCHMEGABYTES; /* Budget for files warmed ahead of requests. */
+	char *tracePath = NULL;     /* Trace file to record sessions in, if -r was given. */
+	char *archivePath = NULL;   /* Archive to serve instead of the working directory, if -a was given. */
+	int option;
+
+	/* Options come first. -u [SOCKET PATH] also listens on a Unix domain socket for local clients.
+	-m [MEGABYTES] caps the memory used for I/O buffers, and -H asks for huge pages for them.
+	-p [MEGABYTES] sets how much file data may be prefetched ahead of requests, 0 turns it off.
+	-r [TRACE FILE] appends a record of every session to a trace file that ftreplay can replay.
+	-a [ARCHIVE] serves the files packed into an archive by ftpack instead of the working directory. */
+
+	while ((option = getopt(argc, argv, "u:m:Hp:r:a:")) != -1)
+	{
+		if (option == 'u')
+		{
+			localPath = optarg;
+		}
+
+		else if (option == 'm' && atoi(optarg) > 0)
+		{
+			poolMegabytes = atoi(optarg);
+		}
+
+		else if (option == 'H')
+		{
+			hugePages = 1;
+		}
+
+		else if (option == 'p' && atoi(optarg) >= 0)
+		{
+			prefetchMegabytes = atoi(optarg);
+		}
+
+		else if (option == 'r')
+		{
+			tracePath = optarg;
+		}
+
+		else if (option == 'a')
+		{
+			archivePath = optarg;
+		}
+
+		else
+		{
+			fprintf(stderr, "Usage: [PROGRAM NAME] [-u SOCKET PATH] [-m POOL MEGABYTES] [-H] [-p PREFETCH MEGABYTES] [-r TRACE FILE] [-a ARCHIVE] [PORT NUMBER]\n\n");
+			exit(0);
+		}
+	}
 
-	/* Verify number of arguments. Should be 2. First argument is the program name,
-	and the second is the port number that the server should listen on. */
+	/* Verify number of arguments. After the options, only the port number that the server
+	should listen on is left. */
 
-	if (argc != 2)
+	if (argc - optind != 1)
 	{
-		fprintf(stderr, "Invalid number of arguments. Usage: [PROGRAM NAME] [PORT NUMBER]\n\n");
+		fprintf(stderr, "Invalid number of arguments. Usage: [PROGRAM NAME] [-u SOCKET PATH] [-m POOL MEGABYTES] [-H] [-p PREFETCH MEGABYTES] [-r TRACE FILE] [-a ARCHIVE] [PORT NUMBER]\n\n");
 		exit(0);
 	}
 
 	/* Validate port number. */
 
-	int serverPort = portValidation(argv[1]);
+	int serverPort = portValidation(argv[optind]);
 
 	/* If port isn't valid, print appropriate error message. */
 
@@ -400,13 +828,128 @@ int main(int argc, char *argv[])
 
 	printf("Starting server on Port %d\n", serverPort); /* Print message indicating the server is starting up on the particular port. */
 
+	/* Map the buffer pool before any children exist so they all share it. Sessions wait for a
+	buffer when every one is in use, so this is all the buffer memory the server will ever use. */
+
+	pool = createPool(MAXBUFFER, (size_t) poolMegabytes * 1024 * 1024, hugePages);
+
+	if (pool == NULL)
+	{
+		fprintf(stderr, "Error. Failed to create a %d MB buffer pool.\n", poolMegabytes);
+		exit(1);
+	}
+
+	printf("Buffer pool has %d buffers of %zu bytes\n", poolBufferCount(pool), poolBufferSize(pool));
+
+	/* The archive is mapped once here and every session reads the same pages. */
+
+	if (archivePath != NULL)
+	{
+		archive = openArchive(archivePath);
+
+		if (archive == NULL)
+		{
+			fprintf(stderr, "Error. %s is not an archive made by ftpack.\n", archivePath);
+			exit(1);
+		}
+
+		printf("Serving %u files from archive %s\n", archiveFileCount(archive), archivePath);
+	}
+
+	/* The prefetcher is shared the same way, and its warming process starts here. With a budget of 0 it is never created
+	and every call to it does nothing. It warms files in the working directory, so it has nothing to do when serving an archive. */
+
+	if (prefetchMegabytes > 0 && archive == NULL)
+	{
+		prefetcher = createPrefetcher((uint64_t) prefetchMegabytes * 1024 * 1024);
+
+		if (prefetcher == NULL)
+		{
+			fprintf(stderr, "Error. Failed to set up the prefetcher.\n");
+			exit(1);
+		}
+
+		printf("Prefetching up to %d MB ahead of requests\n", prefetchMegabytes);
+	}
+
+	/* The trace is opened once here. Children inherit the descriptor, and O_APPEND keeps their records whole. */
+
+	if (tracePath != NULL)
+	{
+		traceDescriptor = openTrace(tracePath);
+
+		if (traceDescriptor < 0)
+		{
+			fprintf(stderr, "Error. Failed to open trace file %s\n", tracePath);
+			exit(1);
+		}
+
+		printf("Recording sessions to %s\n", tracePath);
+	}
+
+	if (localPath != NULL)
+	{
+		localDescriptor = startLocalServer(localPath);
+
+		if (localDescriptor < 0)
+		{
+			fprintf(stderr, "Error. Failed to listen on local socket %s\n", localPath);
+			exit(1);
+		}
+
+		printf("Listening for local clients on %s\n", localPath);
+	}
+
+	/* Wait on both listening sockets. The local one is left out of poll() when it is -1. */
+
+	struct pollfd listeners[2];
+	listeners[0].fd = sockDescriptor;
+	listeners[0].events = POLLIN;
+	listeners[1].fd = localDescriptor;
+	listeners[1].events = POLLIN;
+
+	/* SIGCHLD and SIGUSR1 stay blocked except inside ppoll(), which unblocks them for exactly as long as
+	it waits. A signal arriving anywhere else is held until then, so the flags checked at the top of the
+	loop can never be set just after we looked and leave us asleep. */
+
+	sigset_t handled, waiting;
+	sigemptyset(&handled);
+	sigaddset(&handled, SIGCHLD);
+	sigaddset(&handled, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &handled, &waiting);
+	sigdelset(&waiting, SIGCHLD);
+	sigdelset(&waiting, SIGUSR1);
+
 	int pid; /* Used for child process. */
 
 	/* Now we begin the while loop. We set the value to 1 because we should always listen for connections until it is terminated by an INT signal. */
 
 	while (1)
 	{
-		int clientSocket = accept(sockDescriptor, NULL, NULL);
+		/* Take back any buffers an exited child did not return, and print the prefetch counters if asked. */
+
+		if (childExited)
+		{
+			childExited = 0;
+			reclaimBuffers(pool);
+		}
+
+		if (reportRequested)
+		{
+			reportRequested = 0;
+			printPrefetchStats();
+		}
+
+		/* A pending SIGCHLD or SIGUSR1 is delivered as soon as ppoll() unblocks it, so it returns at once
+		with EINTR and we go around to handle it. */
+
+		if (ppoll(listeners, 2, NULL, &waiting) < 0)
+		{
+			continue;
+		}
+
+		int local = (listeners[1].revents & POLLIN) != 0;
+		int clientSocket = accept(local ? localDescriptor : sockDescriptor, NULL, NULL);
 
 		/* If failed to accept client socket connection, we close it. */
 
@@ -420,6 +963,15 @@ int main(int argc, char *argv[])
 
 		else
 		{
+			/* Note the arrival time before forking, so time spent starting the child counts toward the session. */
+
+			if (traceDescriptor >= 0)
+			{
+				memset(&sessionTrace, 0, sizeof(sessionTrace));
+				sessionTrace.arrival = traceClock();
+				sessionTrace.flags = local ? TRACE_LOCAL : 0;
+			}
+
 			/* fork process */
 			pid = fork();
 
@@ -435,12 +987,51 @@ int main(int argc, char *argv[])
 
 			else if (pid == 0)
 			{
+				sigprocmask(SIG_SETMASK, &waiting, NULL); /* Sessions take signals as usual. */
+
+				/* Borrow this session's buffer. If the pool is empty, wait here until another session finishes. */
+
+				sessionBuffer = borrowBuffer(pool);
+
+				if (sessionBuffer == NULL)
+				{
+					fprintf(stderr, "Error borrowing a buffer for the session.\n");
+					endSession(clientSocket);
+				}
+
+				receivedMessage = sessionBuffer;
+				sessionTrace.session = getpid();
+				sessionTrace.client = local ? 0 : clientAddress(clientSocket);
+
+				/* Local clients have their own, simpler session. serveLocal() never returns. */
+
+				if (local)
+				{
+					printf("Local client connected. Beginning session.\n");
+					serveLocal(clientSocket);
+				}
+
 				printf("Client connected. Beginning session.\n");
 
-				int requestNumber = handleRequest(clientSocket, receivedMessage);
+				initReader(&reader, clientSocket);
+
+				int requestNumber = handleRequest(&reader, receivedMessage);
 				printf("Request # is: %d\n", requestNumber);
 
-				dataPortNumber = receiveNumber(clientSocket); /* Get port number that will be used in client data socket connection. */
+				if (requestNumber != 0)
+				{
+					traceRequest(requestNumber, NULL);
+				}
+
+				/* Get port number that will be used in client data socket connection. */
+
+				status = (requestNumber == 0) ? -1 : receiveNumber(&reader, &dataPortNumber);
+
+				if (status == 0 && clientGone(clientSocket))
+				{
+					fprintf(stderr, "Client hung up before the data connection was opened.\n");
+					endSession(clientSocket);
+				}
 
 				if (status == 0)  /* If message received. */
 				{
@@ -450,45 +1041,48 @@ int main(int argc, char *argv[])
 					printf("Opening Data Connection on Port %d\n", dataPortNumber);
 
 					// listen on it for the connection
-					int clientDataSocket = accept(clientDataSocketFD, NULL, NULL);
+					int clientDataSocket = (clientDataSocketFD < 0) ? -1 : acceptData(clientDataSocketFD);
 
-					/* Handling -l list command here. */
+					/* Stop listening as soon as our client is connected. A client reusing this port for its
+					next request must not land in our backlog while we are still sending. */
 
-					if (requestNumber == 1) 
+					if (clientDataSocketFD >= 0)
 					{
-						char directory[BUFFER];
+						close(clientDataSocketFD);
+					}
 
-						/* Get full path for current working directory and put it in the buffer variable. */
-						getcwd(buffer, BUFFER);
+					if (clientDataSocket < 0)
+					{
+						fprintf(stderr, "Error opening data connection on Port %d\n", dataPortNumber);
+						sendResponse("Could not open data connection.", clientSocket);
+						endSession(clientSocket);
+					}
 
+					/* Handling -l list command here. */
 
-						/* get the contents of the directory. */ 
+					if (requestNumber == 1) 
+					{
+						char *directory = sessionBuffer + BUFFER; /* Listing goes after the request in the session buffer. */
 
-						DIR *dirpointer = NULL; /* Create directory pointer. */
-						dirpointer = opendir(buffer); /* Open directory at buffer path. */
-						struct dirent *dirstruct = NULL; /* Create directory structure. */
+						/* Get the contents of the current working directory. */
 
-						while ((dirstruct = readdir(dirpointer)) != NULL) 
-						{
-							/* Filter out . and .. listings and build the directory list appropriately. */
+						char firstName[NAMELENGTH]; /* First entry, for the prefetcher. */
+						uint32_t length;
 
-							if ((strncmp(dirstruct->d_name, ".", strlen(dirstruct->d_name)) != 0) && (strncmp(dirstruct->d_name, "..", strlen(dirstruct->d_name)) != 0)) 
-							{
-								strncat(directory, "[", 1); /* left bracket.*/
-								strncat(directory, dirstruct->d_name, strlen(dirstruct->d_name));  /* name. */
-								strncat(directory, "] ", 2); /* right bracket. */
-							}
-						}
+						const char *listing = getListing(directory, poolBufferSize(pool) - BUFFER, firstName, &length);
 						
 						/* Send response on control connection to set up sending the list via the data connection. */
 
-						sendResponse(sentMessage, "DATA", clientSocket);
+						sendResponse("DATA", clientSocket);
 
 						/* Send directory list. */
 
-						sendResponse(sentMessage, directory, clientDataSocket);
-						close(clientSocket); /* Close client socket. */
-						_exit(0); /* _exit(0) used because exiting child process. */
+						traceServed(sendFrame(clientDataSocket, listing, length), length);
+
+						/* Clients usually go on to fetch files from the listing, so start warming. */
+
+						prefetchRequest(prefetcher, clientAddress(clientSocket), PREFETCH_LISTING, firstName);
+						endSession(clientSocket); /* Close client socket. */
 					}
 
 					/* Next we handle the -g get command. In these cases, the requestNumber will equal 2 instead of 1. */
@@ -497,55 +1091,54 @@ int main(int argc, char *argv[])
 					{
 						/* Get filename into receivedMessage string. */
 
-						size = receiveNumber(clientSocket);
-						status = receiveMessage(clientSocket, receivedMessage, size);
+						status = receiveFrame(&reader, receivedMessage, BUFFER, &size);
 
-						receivedMessage[size] = '\0'; /* Add null terminator.*/
+						if (status != 0)
+						{
+							fprintf(stderr, "Error in receiving the filename from the client.\n");
+							endSession(clientSocket);
+						}
 
 						printf("Client has requested the following file: [%s]\n", receivedMessage);
+						traceName = receivedMessage;
 
-						/* Validate file exists and get full path for current working directory. */
-						getcwd(buffer, BUFFER);
-
-						/* Get directory contents like we did with the listing command. */
-
-						DIR *dirpointer = NULL;
-						dirpointer = opendir(buffer);
-						struct dirent *dirstruct = NULL;
-
-						int validFile = 0; /* Initially set validFile to false. */
+						/* Validate file exists in the current working directory. */
 
-						while ((dirstruct = readdir(dirpointer)) != NULL) 
-						{
-							/* Compare the file name the client gave us to all file names. If it is found, set validFile to true. */
-
-							if (strncmp(receivedMessage, dirstruct->d_name, max(strlen(dirstruct->d_name), strlen(receivedMessage))) == 0) 
-							{
-								validFile = 1;	/* Set valid file to true if the file is found. */
-							}
-						}
+						char nextName[NAMELENGTH]; /* Entry after the requested file, for the prefetcher. */
+						const char *contents;      /* The file in the archive, when there is one. */
+						uint64_t length;
+						int validFile = (archive != NULL) ? findArchiveFile(archive, receivedMessage, &contents, &length) : findFile(receivedMessage, nextName);
 
 						// file exists
 						if (validFile == 1) 
 						{
 							printf("[%s] is a valid filename\n", receivedMessage);
 							
-							/* Read the file into file buffer. */
+							/* Send response on control connection to set up sending the file via the data connection. */
 
-							char filebuffer[MAXBUFFER];
-							readFile(receivedMessage, filebuffer);
+							sendResponse("DATA", clientSocket);
 
-							/* Send response on control connection to set up sending the file via the data connection. */
+							/* From an archive, the file goes out in one frame straight from the mapping. */
+
+							if (archive != NULL)
+							{
+								traceServed(sendFrame(clientDataSocket, contents, length), length);
+								close(clientDataSocket);
+								printf("Transfer Complete\n");
+								endSession(clientSocket);
+							}
+
+							/* Score this request and start warming the likely next files. The kernel reads them
+							in the background while we stream this one. */
 
-							sendResponse(sentMessage, "DATA", clientSocket);
+							prefetchRequest(prefetcher, clientAddress(clientSocket), receivedMessage, nextName);
 
-							/* Send file over data port.*/
+							/* Stream file over data port through the rest of the session buffer.*/
 
-							sendFile(filebuffer, clientDataSocket, clientSocket);
+							sendFile(receivedMessage, sessionBuffer + BUFFER, poolBufferSize(pool) - BUFFER, clientDataSocket);
 
 							printf("Transfer Complete\n");
-							close(clientSocket); // just to be sure
-							_exit(0); /* _exit(0) used because exiting child process. */
+							endSession(clientSocket); // just to be sure
 
 						}
 
@@ -555,9 +1148,8 @@ int main(int argc, char *argv[])
 
 							/* Send error message through control connection. */
 
-							sendResponse(sentMessage, "Requested file does not exist.", clientSocket);
-							close(clientSocket);
-							_exit(0); /* _exit(0) used because exiting child process. */
+							sendResponse("Requested file does not exist.", clientSocket);
+							endSession(clientSocket);
 						}
 
 					}
@@ -567,9 +1159,8 @@ int main(int argc, char *argv[])
 
 					else 
 					{
-						sendResponse(sentMessage, "Invalid command. Only -g and -l are valid commands.\n", clientSocket);
-						close(clientSocket);
-						_exit(0); /* _exit(0) used because exiting child process. */
+						sendResponse("Invalid command. Only -g and -l are valid commands.\n", clientSocket);
+						endSession(clientSocket);
 					}
 				}
 
@@ -579,8 +1170,7 @@ int main(int argc, char *argv[])
 				else
 				{
 					fprintf(stderr, "Error in receiving a message from the client.\n");
-					close(clientSocket);
-					_exit(0); /* _exit(0) used because exiting child process. */
+					endSession(clientSocket);
 				}
 			}
 
@@ -588,7 +1178,8 @@ int main(int argc, char *argv[])
 
 			else
 			{
-				/* Nothing here. We just need to finish the if - else if - else conditional chain. */
+				/* The child has its own copy of the client socket, so close ours or the parent runs out of descriptors. */
+				close(clientSocket);
 			}
 		} /* End of the else statement at the beginning of the while loop. */
 
@@ -0,0 +1,424 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Implementation of the prefetcher. See prefetch.h.
+**
+** Three fixed tables sit in one shared mapping:
+**   transitions - for each file, the file most often requested after it (majority vote).
+**   clients     - the last thing each client asked for, keyed by address.
+**   warmed      - files warmed but not requested yet, oldest first, with their sizes. Their
+**                 total is kept under the budget by forgetting the oldest.
+** Tables are small and overwrite on collision, since a lost prediction only costs a miss.
+**
+** Sessions send candidates to the warming process as fixed size records on a non-blocking pipe.
+** A record is smaller than PIPE_BUF, so writes from concurrent sessions never interleave, and when
+** the pipe is full the candidate is dropped rather than making the session wait.
+***********************/
+
+#define _GNU_SOURCE /* pipe2(). */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "prefetch.h"
+
+/* Longest filename tracked, including the terminator. Same as a directory entry's name. */
+#define PREFETCH_NAME 256
+
+#define PREFETCH_TRANSITIONS 4096
+#define PREFETCH_CLIENTS 256
+#define PREFETCH_WARMED 256
+
+/* How many neighbouring slots to look through before overwriting a transition. */
+#define PREFETCH_PROBE 8
+
+struct transition
+{
+	char from[PREFETCH_NAME];
+	char to[PREFETCH_NAME];
+	uint32_t votes;
+};
+
+struct clientHistory
+{
+	uint32_t address;
+	int used;
+	char last[PREFETCH_NAME];
+};
+
+struct warmedFile
+{
+	char name[PREFETCH_NAME];
+	uint64_t bytes;
+	int used;
+};
+
+struct prefetcher
+{
+	pthread_mutex_t lock;
+	int candidates; /* Write end of the pipe to the warming process. */
+	struct prefetchStats stats;
+	int warmedNext; /* Slot the next warmed file goes in. Also the oldest entry. */
+	struct transition transitions[PREFETCH_TRANSITIONS];
+	struct clientHistory clients[PREFETCH_CLIENTS];
+	struct warmedFile warmed[PREFETCH_WARMED];
+};
+
+/* FNV-1a hash of a name. */
+
+static uint32_t hashName(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name != '\0')
+	{
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* Same robust locking as the buffer pool: a session dying with the lock held leaves at worst
+one stale table entry, so recover the mutex and carry on. */
+
+static void lockPrefetcher(struct prefetcher *prefetcher)
+{
+	if (pthread_mutex_lock(&prefetcher->lock) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&prefetcher->lock);
+	}
+}
+
+/* Find the transition slot for name: its own slot if present, else an empty one nearby, else the
+home slot to overwrite. Caller holds the lock. */
+
+static struct transition *findTransition(struct prefetcher *prefetcher, const char *name)
+{
+	uint32_t home = hashName(name) % PREFETCH_TRANSITIONS;
+	int i;
+
+	for (i = 0; i < PREFETCH_PROBE; i++)
+	{
+		struct transition *slot = &prefetcher->transitions[(home + i) % PREFETCH_TRANSITIONS];
+
+		if (slot->from[0] == '\0' || strcmp(slot->from, name) == 0)
+		{
+			return slot;
+		}
+	}
+
+	return &prefetcher->transitions[home];
+}
+
+/* Count a vote for "to follows from". The current prediction stays until other files have
+outvoted it, so one stray request does not undo a pattern. Caller holds the lock. */
+
+static void learnTransition(struct prefetcher *prefetcher, const char *from, const char *to)
+{
+	struct transition *slot = findTransition(prefetcher, from);
+
+	if (strcmp(slot->from, from) != 0)
+	{
+		strcpy(slot->from, from);
+		slot->to[0] = '\0';
+		slot->votes = 0;
+	}
+
+	if (strcmp(slot->to, to) == 0)
+	{
+		slot->votes += (slot->votes < 1000) ? 1 : 0;
+	}
+
+	else if (slot->votes > 1)
+	{
+		slot->votes--;
+	}
+
+	else
+	{
+		strcpy(slot->to, to);
+		slot->votes = 1;
+	}
+}
+
+/* Return the slot holding name in the warmed list, or -1. Caller holds the lock. */
+
+static int findWarmed(struct prefetcher *prefetcher, const char *name)
+{
+	int i;
+
+	for (i = 0; i < PREFETCH_WARMED; i++)
+	{
+		if (prefetcher->warmed[i].used && strcmp(prefetcher->warmed[i].name, name) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Drop a warmed entry and give its bytes back to the budget. Caller holds the lock. */
+
+static void forgetWarmed(struct prefetcher *prefetcher, int slot)
+{
+	prefetcher->stats.inUse -= prefetcher->warmed[slot].bytes;
+	prefetcher->warmed[slot].used = 0;
+}
+
+/* Ask the kernel to start reading name, if it fits the budget and is not already warm. Opening
+the file here also pulls its directory entry and inode into cache. */
+
+static void warmFile(struct prefetcher *prefetcher, const char *name)
+{
+	struct stat info;
+	int fileDescriptor;
+	int admitted = 0;
+
+	lockPrefetcher(prefetcher);
+	int alreadyWarm = findWarmed(prefetcher, name) >= 0;
+	pthread_mutex_unlock(&prefetcher->lock);
+
+	if (alreadyWarm || (fileDescriptor = open(name, O_RDONLY | O_NONBLOCK)) < 0)
+	{
+		return;
+	}
+
+	if (fstat(fileDescriptor, &info) == 0 && S_ISREG(info.st_mode))
+	{
+		uint64_t bytes = info.st_size;
+
+		lockPrefetcher(prefetcher);
+
+		if (bytes > prefetcher->stats.budget)
+		{
+			prefetcher->stats.overBudget++;
+		}
+
+		else if (findWarmed(prefetcher, name) < 0)
+		{
+			/* Forget the oldest warmed files until this one fits. The slot we land on is then free. */
+
+			int checked = 0;
+
+			while (checked < PREFETCH_WARMED && (prefetcher->stats.inUse + bytes > prefetcher->stats.budget || prefetcher->warmed[prefetcher->warmedNext].used))
+			{
+				int oldest = (prefetcher->warmedNext + checked) % PREFETCH_WARMED;
+
+				if (prefetcher->warmed[oldest].used)
+				{
+					forgetWarmed(prefetcher, oldest);
+				}
+
+				checked++;
+			}
+
+			struct warmedFile *entry = &prefetcher->warmed[prefetcher->warmedNext];
+			strcpy(entry->name, name);
+			entry->bytes = bytes;
+			entry->used = 1;
+			prefetcher->warmedNext = (prefetcher->warmedNext + 1) % PREFETCH_WARMED;
+			prefetcher->stats.inUse += bytes;
+			prefetcher->stats.warmed++;
+			admitted = 1;
+		}
+
+		pthread_mutex_unlock(&prefetcher->lock);
+
+		if (admitted)
+		{
+			posix_fadvise(fileDescriptor, 0, info.st_size, POSIX_FADV_WILLNEED);
+		}
+	}
+
+	close(fileDescriptor);
+}
+
+/* The warming process. Warms each name that comes down the pipe until every session and the
+server have closed their end. */
+
+static void warmCandidates(struct prefetcher *prefetcher, int candidates)
+{
+	char name[PREFETCH_NAME];
+	ssize_t status;
+	int fd;
+
+	/* Let go of everything inherited from the server, like its listening socket, so a dead server
+	does not leave its port held by us. */
+
+	for (fd = 3; fd < getdtablesize(); fd++)
+	{
+		if (fd != candidates)
+		{
+			close(fd);
+		}
+	}
+
+	while ((status = read(candidates, name, PREFETCH_NAME)) != 0)
+	{
+		if (status == PREFETCH_NAME && memchr(name, '\0', PREFETCH_NAME) != NULL)
+		{
+			warmFile(prefetcher, name);
+		}
+
+		else if (status < 0 && errno != EINTR)
+		{
+			break;
+		}
+	}
+
+	_exit(0);
+}
+
+struct prefetcher *createPrefetcher(uint64_t budgetBytes)
+{
+	struct prefetcher *prefetcher;
+	pthread_mutexattr_t attributes;
+
+	if (budgetBytes == 0)
+	{
+		return NULL;
+	}
+
+	/* Anonymous shared mappings start zeroed, so every table starts empty. */
+
+	prefetcher = mmap(NULL, sizeof(*prefetcher), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (prefetcher == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	prefetcher->stats.budget = budgetBytes;
+
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&prefetcher->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+
+	/* The server and its sessions write, only the warming process reads. */
+
+	int ends[2];
+	pid_t warmer;
+
+	if (pipe2(ends, O_CLOEXEC) < 0)
+	{
+		munmap(prefetcher, sizeof(*prefetcher));
+		return NULL;
+	}
+
+	if ((warmer = fork()) == 0)
+	{
+		close(ends[1]);
+		warmCandidates(prefetcher, ends[0]);
+	}
+
+	close(ends[0]);
+
+	if (warmer < 0 || fcntl(ends[1], F_SETFL, O_NONBLOCK) < 0)
+	{
+		close(ends[1]);
+		munmap(prefetcher, sizeof(*prefetcher));
+		return NULL;
+	}
+
+	prefetcher->candidates = ends[1];
+	return prefetcher;
+}
+
+/* Hand name to the warming process. */
+
+static void queueWarm(struct prefetcher *prefetcher, const char *name)
+{
+	char record[PREFETCH_NAME];
+
+	memset(record, 0, sizeof(record));
+	strcpy(record, name);
+
+	if (write(prefetcher->candidates, record, sizeof(record)) != sizeof(record))
+	{
+		lockPrefetcher(prefetcher);
+		prefetcher->stats.dropped++;
+		pthread_mutex_unlock(&prefetcher->lock);
+	}
+}
+
+void prefetchRequest(struct prefetcher *prefetcher, uint32_t client, const char *name, const char *listingNext)
+{
+	char predicted[PREFETCH_NAME] = "";
+	int listing = strcmp(name, PREFETCH_LISTING) == 0;
+
+	if (prefetcher == NULL || strlen(name) >= PREFETCH_NAME)
+	{
+		return;
+	}
+
+	lockPrefetcher(prefetcher);
+
+	/* Score the request against what we warmed. */
+
+	if (!listing)
+	{
+		int slot = findWarmed(prefetcher, name);
+
+		if (slot >= 0)
+		{
+			prefetcher->stats.hits++;
+			forgetWarmed(prefetcher, slot);
+		}
+
+		else
+		{
+			prefetcher->stats.misses++;
+		}
+	}
+
+	/* Learn from this client's previous request, then remember this one. */
+
+	struct clientHistory *history = &prefetcher->clients[client % PREFETCH_CLIENTS];
+
+	if (history->used && history->address == client && history->last[0] != '\0')
+	{
+		learnTransition(prefetcher, history->last, name);
+	}
+
+	history->used = 1;
+	history->address = client;
+	strcpy(history->last, name);
+
+	/* What has usually come after this request? */
+
+	struct transition *slot = findTransition(prefetcher, name);
+
+	if (strcmp(slot->from, name) == 0)
+	{
+		strcpy(predicted, slot->to);
+	}
+
+	pthread_mutex_unlock(&prefetcher->lock);
+
+	if (predicted[0] != '\0' && strcmp(predicted, name) != 0 && strcmp(predicted, PREFETCH_LISTING) != 0)
+	{
+		queueWarm(prefetcher, predicted);
+	}
+
+	if (listingNext != NULL && strlen(listingNext) < PREFETCH_NAME && strcmp(listingNext, predicted) != 0)
+	{
+		queueWarm(prefetcher, listingNext);
+	}
+}
+
+void prefetchStats(struct prefetcher *prefetcher, struct prefetchStats *stats)
+{
+	lockPrefetcher(prefetcher);
+	*stats = prefetcher->stats;
+	pthread_mutex_unlock(&prefetcher->lock);
+}
@@ -0,0 +1,54 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Prefetcher for ftserver. Clients nearly always follow a -l with -g requests for
+** names in that listing, often in listing order, so each -g is a good hint about the next one.
+** The prefetcher learns which file tends to follow which, per client and overall, and asks the
+** kernel to start reading the likely next files (posix_fadvise WILLNEED) while the current
+** transfer runs. Like the buffer pool, its tables live in shared memory mapped before the first
+** fork, so every session learns from every other.
+**
+** The opens that warming needs can be slow on network filesystems and spinning disks, so sessions
+** never do them. A session only updates the tables and drops the predicted names into a pipe, and
+** a warming process forked by createPrefetcher() opens and warms them in the background.
+***********************/
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Name used as the "previous file" right after a client asks for a listing, so the prefetcher
+also learns which file clients fetch first after -l. */
+#define PREFETCH_LISTING "-l"
+
+struct prefetcher;
+
+/* Counters reported by prefetchStats(). */
+
+struct prefetchStats
+{
+	uint64_t hits;       /* -g requests for a file that had been warmed. */
+	uint64_t misses;     /* -g requests for a file that had not been warmed. */
+	uint64_t warmed;     /* Files warmed. */
+	uint64_t overBudget; /* Candidates skipped because they did not fit the budget. */
+	uint64_t dropped;    /* Candidates dropped because the warming process was behind. */
+	uint64_t budget;     /* Bytes that may be warmed but not yet requested at once. */
+	uint64_t inUse;      /* Bytes warmed and not yet requested. */
+};
+
+/* Map the prefetcher's shared tables and fork the warming process, which works in the current
+directory. budgetBytes caps how much warmed but not yet requested file data the prefetcher keeps in
+flight. Returns NULL on failure or if budgetBytes is 0. */
+struct prefetcher *createPrefetcher(uint64_t budgetBytes);
+
+/* Record that client (an IPv4 address, 0 for local clients) asked for name, which is a file
+or PREFETCH_LISTING. Counts a hit or miss, learns the transition from the client's previous
+request, and hands the files predicted to come next to the warming process. listingNext is the
+entry after name in the directory listing, or NULL, and is handed over too. Never blocks on I/O. */
+void prefetchRequest(struct prefetcher *prefetcher, uint32_t client, const char *name, const char *listingNext);
+
+/* Copy the current counters into stats. */
+void prefetchStats(struct prefetcher *prefetcher, struct prefetchStats *stats);
+
+#endif
@@ -0,0 +1,182 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Implementation of session traces. See trace.h for the file layout.
+***********************/
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+/* Longest record we write: the fixed part plus a filename of up to 64 KB. */
+#define TRACE_MAXRECORD (TRACE_RECORDSIZE + 65535)
+
+uint64_t traceClock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Pack the fixed fields into out in network byte order. */
+
+static void packRecord(const struct traceRecord *record, unsigned char *out)
+{
+	uint64_t arrival = htobe64(record->arrival);
+	uint64_t bytes = htobe64(record->bytes);
+	uint32_t client = htobe32(record->client);
+	uint32_t session = htobe32(record->session);
+	uint32_t duration = htobe32(record->duration);
+	uint16_t nameLength = htobe16(record->nameLength);
+
+	memcpy(out, &arrival, 8);
+	memcpy(out + 8, &bytes, 8);
+	memcpy(out + 16, &client, 4);
+	memcpy(out + 20, &session, 4);
+	memcpy(out + 24, &duration, 4);
+	out[28] = record->command;
+	out[29] = record->flags;
+	memcpy(out + 30, &nameLength, 2);
+}
+
+/* Unpack the fixed fields from in. */
+
+static void unpackRecord(const unsigned char *in, struct traceRecord *record)
+{
+	uint64_t arrival, bytes;
+	uint32_t client, session, duration;
+	uint16_t nameLength;
+
+	memcpy(&arrival, in, 8);
+	memcpy(&bytes, in + 8, 8);
+	memcpy(&client, in + 16, 4);
+	memcpy(&session, in + 20, 4);
+	memcpy(&duration, in + 24, 4);
+	memcpy(&nameLength, in + 30, 2);
+
+	record->arrival = be64toh(arrival);
+	record->bytes = be64toh(bytes);
+	record->client = be32toh(client);
+	record->session = be32toh(session);
+	record->duration = be32toh(duration);
+	record->command = in[28];
+	record->flags = in[29];
+	record->nameLength = be16toh(nameLength);
+}
+
+int openTrace(const char *path)
+{
+	char magic[TRACE_MAGICLENGTH];
+	struct stat info;
+	int traceDescriptor = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+	if (traceDescriptor < 0 || fstat(traceDescriptor, &info) < 0)
+	{
+		return -1;
+	}
+
+	/* A new file gets the magic. An existing one must already start with it. */
+
+	if (info.st_size == 0)
+	{
+		if (write(traceDescriptor, TRACE_MAGIC, TRACE_MAGICLENGTH) != TRACE_MAGICLENGTH)
+		{
+			close(traceDescriptor);
+			return -1;
+		}
+	}
+
+	else
+	{
+		int reader = open(path, O_RDONLY | O_CLOEXEC);
+		int valid = reader >= 0 && read(reader, magic, TRACE_MAGICLENGTH) == TRACE_MAGICLENGTH && memcmp(magic, TRACE_MAGIC, TRACE_MAGICLENGTH) == 0;
+
+		if (reader >= 0)
+		{
+			close(reader);
+		}
+
+		if (!valid)
+		{
+			close(traceDescriptor);
+			return -1;
+		}
+	}
+
+	return traceDescriptor;
+}
+
+int writeTraceRecord(int traceDescriptor, const struct traceRecord *record, const char *name)
+{
+	unsigned char buffer[TRACE_MAXRECORD];
+	struct traceRecord copy = *record;
+	ssize_t status;
+
+	copy.nameLength = (name != NULL) ? strnlen(name, 65535) : 0;
+	packRecord(&copy, buffer);
+
+	if (copy.nameLength > 0)
+	{
+		memcpy(buffer + TRACE_RECORDSIZE, name, copy.nameLength);
+	}
+
+	/* One write() per record. With O_APPEND the kernel places it at the end as a unit. */
+
+	do
+	{
+		status = write(traceDescriptor, buffer, TRACE_RECORDSIZE + copy.nameLength);
+	} while (status < 0 && errno == EINTR);
+
+	return (status == TRACE_RECORDSIZE + copy.nameLength) ? 0 : -1;
+}
+
+int readTraceHeader(FILE *trace)
+{
+	char magic[TRACE_MAGICLENGTH];
+
+	if (fread(magic, 1, TRACE_MAGICLENGTH, trace) != TRACE_MAGICLENGTH || memcmp(magic, TRACE_MAGIC, TRACE_MAGICLENGTH) != 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int readTraceRecord(FILE *trace, struct traceRecord *record, char *name, size_t nameSize)
+{
+	unsigned char fixed[TRACE_RECORDSIZE];
+	size_t count = fread(fixed, 1, TRACE_RECORDSIZE, trace);
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	if (count != TRACE_RECORDSIZE)
+	{
+		return -1;
+	}
+
+	unpackRecord(fixed, record);
+
+	/* A name too long for the caller is skipped, so one odd request does not end the trace early. */
+
+	if (record->nameLength >= nameSize)
+	{
+		name[0] = '\0';
+		return (fseek(trace, record->nameLength, SEEK_CUR) == 0) ? 1 : -1;
+	}
+
+	if (fread(name, 1, record->nameLength, trace) != record->nameLength)
+	{
+		return -1;
+	}
+
+	name[record->nameLength] = '\0';
+	return 1;
+}
@@ -0,0 +1,64 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Session traces for ftserver. With -r, the server appends one record per session
+** to a binary trace file: when the request arrived, who sent it, the command, the filename, how
+** many payload bytes were sent, and whether the request was served. ftreplay reads the file back
+** and replays it against test servers. Every session writes its record with a single write() to a
+** file opened with O_APPEND, so records from concurrent sessions never interleave.
+**
+** File layout: the 8 byte magic "FTTRACE2", then records. Each record is the fixed fields below in
+** network byte order followed by nameLength bytes of filename (no terminator).
+***********************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "FTTRACE2"
+#define TRACE_MAGICLENGTH 8
+
+/* Size of the fixed part of a record on disk. */
+#define TRACE_RECORDSIZE 32
+
+/* Values of command. The first two match handleRequest() in ftserver.c. */
+#define TRACE_LIST 1
+#define TRACE_GET 2
+#define TRACE_INVALID 0
+
+/* Bits of flags. */
+#define TRACE_LOCAL 1  /* The client came in on the Unix domain socket. */
+#define TRACE_SERVED 2 /* The listing or file went out in full. Unset for refused and failed requests. */
+
+struct traceRecord
+{
+	uint64_t arrival;    /* Nanoseconds since the epoch when the session was accepted. */
+	uint64_t bytes;      /* Payload bytes sent to the client. */
+	uint32_t client;     /* Client IPv4 address, 0 for local clients. */
+	uint32_t session;    /* Process id of the session. */
+	uint32_t duration;   /* Microseconds from arrival to the end of the session. */
+	uint8_t command;     /* TRACE_LIST, TRACE_GET or TRACE_INVALID. */
+	uint8_t flags;       /* TRACE_LOCAL and TRACE_SERVED. */
+	uint16_t nameLength; /* Bytes of filename following the record. */
+};
+
+/* Open path for appending records, writing the magic if the file is new. Returns the file
+descriptor, or -1 on failure or if an existing file is not a trace. */
+int openTrace(const char *path);
+
+/* Append one record and its filename (NULL for none) with a single write(). Returns 0 or -1. */
+int writeTraceRecord(int traceDescriptor, const struct traceRecord *record, const char *name);
+
+/* Check the magic at the start of a trace opened for reading. Returns 0 if it is a trace, -1 if not. */
+int readTraceHeader(FILE *trace);
+
+/* Read the next record. name must hold nameSize bytes and receives the NUL terminated filename. A
+filename that does not fit is skipped over and name comes back empty. Returns 1 if a record was read,
+0 at the end of the file, and -1 if the file is damaged. */
+int readTraceRecord(FILE *trace, struct traceRecord *record, char *name, size_t nameSize);
+
+/* Current time in nanoseconds since the epoch. */
+uint64_t traceClock(void);
+
+#endif
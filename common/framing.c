@@ -0,0 +1,310 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Implementation of the shared message framing. See framing.h for the
+** wire format.
+***********************/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "framing.h"
+
+/* Set up an empty reader over the socket. */
+
+void initReader(struct frameReader *reader, int sockDescriptor)
+{
+	reader->sockDescriptor = sockDescriptor;
+	reader->start = 0;
+	reader->end = 0;
+}
+
+/* Write until every byte has been accepted by the kernel. Interrupted writes are retried. */
+
+int sendAll(int sockDescriptor, const char *data, size_t size)
+{
+	size_t bytesSent = 0;
+
+	while (bytesSent < size)
+	{
+		ssize_t status = write(sockDescriptor, data + bytesSent, size - bytesSent);
+
+		if (status < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+
+		bytesSent += status;
+	}
+
+	return 0;
+}
+
+/* Takes the result of the first write of a frame and sends whatever part of the header and
+payload the kernel did not take. Returns 0 on success, -1 on failure. */
+
+static int finishFrame(int sockDescriptor, ssize_t status, uint32_t *header, const char *payload, uint32_t size)
+{
+	if (status < 0)
+	{
+		return -1;
+	}
+
+	/* Short write inside the header. Rare, but the peer must still see all four bytes. */
+
+	if (status < FRAME_HEADER)
+	{
+		if (sendAll(sockDescriptor, (char *) header + status, FRAME_HEADER - status) < 0)
+		{
+			return -1;
+		}
+		status = FRAME_HEADER;
+	}
+
+	return sendAll(sockDescriptor, payload + (status - FRAME_HEADER), size - (status - FRAME_HEADER));
+}
+
+/* Gather the header and payload into one writev(). */
+
+int sendFrame(int sockDescriptor, const char *payload, uint32_t size)
+{
+	return sendFrameStart(sockDescriptor, size, payload, size);
+}
+
+/* Gather the header and the first piece of payload into one writev(). If the kernel takes only
+part of it, finishFrame() sends the rest. */
+
+int sendFrameStart(int sockDescriptor, uint32_t size, const char *payload, uint32_t pieceSize)
+{
+	uint32_t header = htonl(size);
+	struct iovec parts[2];
+	ssize_t status;
+
+	parts[0].iov_base = &header;
+	parts[0].iov_len = FRAME_HEADER;
+	parts[1].iov_base = (void *) payload;
+	parts[1].iov_len = pieceSize;
+
+	do
+	{
+		status = writev(sockDescriptor, parts, 2);
+	} while (status < 0 && errno == EINTR);
+
+	return finishFrame(sockDescriptor, status, &header, payload, pieceSize);
+}
+
+/* Like sendFrame(), but with sendmsg() so the descriptor rides along as ancillary data. The
+descriptor is attached to the first byte, so only that first sendmsg() needs to carry it. */
+
+int sendFrameDescriptor(int sockDescriptor, const char *payload, uint32_t size, int fd)
+{
+	uint32_t header = htonl(size);
+	struct iovec parts[2];
+	struct msghdr message;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *attached;
+	ssize_t status;
+
+	parts[0].iov_base = &header;
+	parts[0].iov_len = FRAME_HEADER;
+	parts[1].iov_base = (void *) payload;
+	parts[1].iov_len = size;
+
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov = parts;
+	message.msg_iovlen = 2;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	attached = CMSG_FIRSTHDR(&message);
+	attached->cmsg_level = SOL_SOCKET;
+	attached->cmsg_type = SCM_RIGHTS;
+	attached->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(attached), &fd, sizeof(int));
+
+	do
+	{
+		status = sendmsg(sockDescriptor, &message, MSG_NOSIGNAL);
+	} while (status < 0 && errno == EINTR);
+
+	return finishFrame(sockDescriptor, status, &header, payload, size);
+}
+
+/* Refill the reader with one recv(). Unread bytes are moved to the front first.
+Returns the number of new bytes, 0 on close, or -1 on error. */
+
+static ssize_t fillReader(struct frameReader *reader)
+{
+	ssize_t status;
+
+	if (reader->start > 0)
+	{
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+
+	do
+	{
+		status = recv(reader->sockDescriptor, reader->buffer + reader->end, FRAME_READBUFFER - reader->end, 0);
+	} while (status < 0 && errno == EINTR);
+
+	if (status > 0)
+	{
+		reader->end += status;
+	}
+
+	return status;
+}
+
+/* Copy out what is already buffered, then keep reading until size bytes have been delivered.
+Large remainders are read straight into the caller's memory instead of through the buffer. */
+
+int receiveExact(struct frameReader *reader, char *data, size_t size)
+{
+	size_t bytesReceived = 0;
+
+	while (bytesReceived < size)
+	{
+		size_t buffered = reader->end - reader->start;
+
+		if (buffered > 0)
+		{
+			size_t count = size - bytesReceived;
+
+			if (count > buffered)
+			{
+				count = buffered;
+			}
+
+			memcpy(data + bytesReceived, reader->buffer + reader->start, count);
+			reader->start += count;
+			bytesReceived += count;
+			continue;
+		}
+
+		ssize_t status;
+
+		if (size - bytesReceived >= FRAME_READBUFFER)
+		{
+			do
+			{
+				status = recv(reader->sockDescriptor, data + bytesReceived, size - bytesReceived, 0);
+			} while (status < 0 && errno == EINTR);
+
+			if (status > 0)
+			{
+				bytesReceived += status;
+			}
+		}
+
+		else
+		{
+			status = fillReader(reader);
+		}
+
+		/* A close before anything was read is a clean close. A close part way through is an error. */
+
+		if (status == 0)
+		{
+			return (bytesReceived == 0) ? FRAME_CLOSED : -1;
+		}
+
+		else if (status < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Read the 4 byte header and convert it to host byte order. */
+
+int receiveNumber(struct frameReader *reader, uint32_t *number)
+{
+	uint32_t header;
+	int status = receiveExact(reader, (char *) &header, FRAME_HEADER);
+
+	if (status == 0)
+	{
+		*number = ntohl(header);
+	}
+
+	return status;
+}
+
+/* Read the header, check the payload fits, then read the payload and terminate it. */
+
+int receiveFrame(struct frameReader *reader, char *payload, uint32_t capacity, uint32_t *size)
+{
+	uint32_t length;
+	int status = receiveNumber(reader, &length);
+
+	if (status != 0)
+	{
+		return status;
+	}
+
+	if (length >= capacity)
+	{
+		return -1;
+	}
+
+	if (receiveExact(reader, payload, length) != 0)
+	{
+		return -1;
+	}
+
+	payload[length] = '\0';
+	*size = length;
+	return 0;
+}
+
+/* Keep what fits, then read the rest of the frame through a small scratch buffer so the next frame
+starts where it should. */
+
+int receiveFrameTruncated(struct frameReader *reader, char *payload, uint32_t capacity, uint32_t *size)
+{
+	char discard[512];
+	uint32_t length, kept, remaining;
+	int status = receiveNumber(reader, &length);
+
+	if (status != 0)
+	{
+		return status;
+	}
+
+	kept = (length < capacity) ? length : capacity - 1;
+
+	if (receiveExact(reader, payload, kept) != 0)
+	{
+		return -1;
+	}
+
+	payload[kept] = '\0';
+
+	for (remaining = length - kept; remaining > 0; )
+	{
+		uint32_t count = (remaining < sizeof(discard)) ? remaining : sizeof(discard);
+
+		if (receiveExact(reader, discard, count) != 0)
+		{
+			return -1;
+		}
+
+		remaining -= count;
+	}
+
+	*size = length;
+	return 0;
+}
@@ -0,0 +1,72 @@
+/***********************
+** Author: Eddie C. Fox
+** Description: Shared message framing used by chatclient.c (Project 1) and ftserver.c
+** (Project 2). Every message on the wire is a 4 byte length in network byte order followed
+** by exactly that many payload bytes. Frames are sent with a single writev() so the header
+** and payload leave in one segment, and received through a buffered reader so that several
+** frames that arrive in one recv() are parsed without further system calls.
+***********************/
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the length header in front of every frame. */
+#define FRAME_HEADER 4
+
+/* Size of the receive buffer inside each frame reader. */
+#define FRAME_READBUFFER 8192
+
+/* Returned by the receive functions when the peer closed the connection cleanly
+before the first byte of a frame. Every other failure returns -1. */
+#define FRAME_CLOSED -2
+
+/* A buffered reader over one socket. Bytes between start and end have been
+received but not yet handed to the caller. */
+
+struct frameReader
+{
+	int sockDescriptor;
+	size_t start;
+	size_t end;
+	char buffer[FRAME_READBUFFER];
+};
+
+/* Prepare reader to read frames from the given socket. */
+void initReader(struct frameReader *reader, int sockDescriptor);
+
+/* Write all of size bytes from data, retrying short writes. Returns 0 on success, -1 on failure. */
+int sendAll(int sockDescriptor, const char *data, size_t size);
+
+/* Send header and payload as one frame using a single writev() where the kernel allows it.
+Returns 0 on success, -1 on failure. */
+int sendFrame(int sockDescriptor, const char *payload, uint32_t size);
+
+/* Start a frame of size bytes whose payload is too big to hold at once. The header and the first
+pieceSize bytes go out in one writev(), and the caller sends the rest with sendAll().
+Returns 0 on success, -1 on failure. */
+int sendFrameStart(int sockDescriptor, uint32_t size, const char *payload, uint32_t pieceSize);
+
+/* Send one frame over a Unix domain socket with the open file descriptor fd attached through
+SCM_RIGHTS. The receiver gets its own descriptor for the same open file. Returns 0 on success, -1 on failure. */
+int sendFrameDescriptor(int sockDescriptor, const char *payload, uint32_t size, int fd);
+
+/* Receive one frame into payload, which must hold capacity bytes. The payload is NUL
+terminated, so frames of capacity bytes or more are rejected. The payload length is stored
+in size. Returns 0 on success, FRAME_CLOSED on a clean close, and -1 otherwise. */
+int receiveFrame(struct frameReader *reader, char *payload, uint32_t capacity, uint32_t *size);
+
+/* Like receiveFrame(), but a frame too big for payload is not an error. The first capacity - 1
+bytes are kept and terminated, the rest is read and dropped, and size holds the full length, so
+size >= capacity means the payload was cut short. */
+int receiveFrameTruncated(struct frameReader *reader, char *payload, uint32_t capacity, uint32_t *size);
+
+/* Receive a bare 4 byte number in network byte order. Same return values as receiveFrame(). */
+int receiveNumber(struct frameReader *reader, uint32_t *number);
+
+/* Receive exactly size raw bytes. Same return values as receiveFrame(). */
+int receiveExact(struct frameReader *reader, char *data, size_t size);
+
+#endif